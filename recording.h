@@ -0,0 +1,97 @@
+#ifndef SCREEN_WORMS_RECORDING_H
+#define SCREEN_WORMS_RECORDING_H
+
+#include "common.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Recordings are kept in files DIR/recording-SEQ.swr with increasing sequence numbers.
+// Every file is mapped as a whole: a header, an index of fixed capacity and the data
+// region after it. The writer appends chunks of consecutive wrapped events of a single
+// game (exactly as they are sent to clients) to the data region and publishes every
+// chunk with an index entry. All numbers are in the byte order of the writing host.
+#define RECORDING_MAGIC "SWORMREC"
+#define RECORDING_VERSION 1
+#define RECORDING_PREFIX "recording-"
+#define RECORDING_SUFFIX ".swr"
+
+#define MIN_RECORDING_FILES 1
+#define DEFAULT_RECORDING_FILES 8
+#define MAX_RECORDING_FILES 10000
+
+// Size of a recording file in MiB.
+#define MIN_RECORDING_FILE_SIZE 1
+#define DEFAULT_RECORDING_FILE_SIZE 64
+#define MAX_RECORDING_FILE_SIZE 4096
+
+// Bytes of the file per index entry, chunks are usually a few hundred bytes long.
+#define RECORDING_INDEX_RATIO 128
+
+struct RecordingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t indexCapacity;
+    uint64_t sequence;
+    uint64_t fileSize;
+    uint64_t dataStart;
+    // Published with release stores after the chunks they cover are written, read with acquire loads.
+    uint64_t dataEnd;
+    uint32_t indexCount;
+    // Set once the writer has moved on to the next file.
+    uint32_t closed;
+};
+
+// Events [firstEvent, firstEvent + events) of game gameId, played in room room,
+// taking size bytes at offset of the file. Time is the wall clock time in ms
+// when the events were handed to the writer.
+struct RecordingEntry {
+    uint32_t gameId;
+    uint32_t room;
+    uint32_t firstEvent;
+    uint32_t events;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t timeMs;
+};
+
+// Returns path of the recording file with given sequence number.
+std::string recordingPath(const std::string &dir, uint64_t sequence) {
+    return dir + "/" RECORDING_PREFIX + std::to_string(sequence) + RECORDING_SUFFIX;
+}
+
+// Returns sorted sequence numbers of recording files in the directory.
+std::vector<uint64_t> listRecordings(const std::string &dir) {
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        syserr("opendir(%s)", dir.c_str());
+    }
+
+    std::vector<uint64_t> sequences;
+    size_t prefixLen = strlen(RECORDING_PREFIX), suffixLen = strlen(RECORDING_SUFFIX);
+    while (dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() <= prefixLen + suffixLen || name.compare(0, prefixLen, RECORDING_PREFIX) != 0
+            || name.compare(name.size() - suffixLen, suffixLen, RECORDING_SUFFIX) != 0) {
+            continue;
+        }
+
+        std::string digits = name.substr(prefixLen, name.size() - prefixLen - suffixLen);
+        if (digits.find_first_not_of("0123456789") == std::string::npos && digits.size() < 20) {
+            sequences.push_back(std::stoull(digits));
+        }
+    }
+
+    closedir(d);
+    std::sort(sequences.begin(), sequences.end());
+    return sequences;
+}
+
+// Returns the index of a mapped recording file.
+RecordingEntry *recordingIndex(RecordingHeader *header) {
+    return (RecordingEntry *)(header + 1);
+}
+
+#endif //SCREEN_WORMS_RECORDING_H
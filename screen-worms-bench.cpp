@@ -0,0 +1,771 @@
+// Benchmarks of the server's hot paths, every result is printed as a single
+// line of space separated key=value pairs, so it can be compared between commits.
+#define SCREEN_WORMS_NO_MAIN
+#include "screen-worms-server.cpp"
+#include "screen-worms-client.cpp"
+
+#include <chrono>
+#include <malloc.h>
+#include <sys/resource.h>
+
+#define BENCH_PLAYERS 25
+#define BENCH_STEPS 4000000
+#define BENCH_TICKS 2000
+#define BENCH_ROOMS 64
+#define BENCH_ROOM_PLAYERS 10
+#define BENCH_ROOM_TICKS 2000
+#define BENCH_ROOM_LOG_BUDGET (256 << 10)
+#define BENCH_MOVE_TICKS 200000
+#define BENCH_ENCODED_EVENTS 1000000
+#define BENCH_CRC_BYTES (64 << 20)
+#define BENCH_CRC_MAX_CHECKED 1100
+#define BENCH_LOG_EVENTS 4000000
+#define BENCH_LOG_BUDGET (8 << 20)
+#define BENCH_LOG_READS 20000
+#define BENCH_LOG_TAIL 65536
+#define BENCH_LOG_BATCH 64
+
+#define DEFAULT_SIM_PLAYERS 10
+#define DEFAULT_SIM_GAME_TICKS 2000
+#define MAX_SIM_GAME_TICKS 1000000
+#define DEFAULT_SIM_GAMES 20
+#define MAX_SIM_GAMES 100000
+
+// Settings of the simulation benchmarks, set from command line options.
+struct SimOptions {
+    int64_t players;
+    int64_t width, height;
+    int64_t turningSpeed;
+    int64_t gameTicks;
+    int64_t games;
+    std::string filter;
+};
+
+// Number of heap allocations made by the process with operator new.
+std::atomic<uint64_t> allocations{0};
+
+// Neither allocation nor deallocation is inlined, so that the compiler doesn't
+// pair malloc and free with new and delete expressions.
+__attribute__((noinline)) void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+// Position of a worm in the floating point simulation replaced by the fixed-point one.
+struct FloatPos {
+    double x, y;
+};
+
+// Returns the number of bytes currently allocated on the heap.
+size_t heapInUse() {
+    return mallinfo2().uordblks;
+}
+
+// Returns monotonic time in nanoseconds.
+uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Moves worms like the server does, calling visit(x, y) on every field they enter,
+// worms that hit an eaten field are respawned in a random place.
+template<typename Visit>
+uint64_t walkWorms(int64_t width, int64_t height, uint64_t steps, Visit visit) {
+    uint64_t rng = 12345, eliminated = 0;
+    std::vector<PlayerPos> worms(BENCH_PLAYERS);
+    for (auto &w : worms) {
+        w.x = (int64_t)(getNextRand(rng) % width) * FIXED_ONE + FIXED_HALF;
+        w.y = (int64_t)(getNextRand(rng) % height) * FIXED_ONE + FIXED_HALF;
+        w.direction = getNextRand(rng) % 360;
+    }
+
+    for (uint64_t step = 0; step < steps; step++) {
+        PlayerPos &w = worms[step % BENCH_PLAYERS];
+        w.direction = (w.direction + getNextRand(rng) % 13 + 354) % 360;
+        w.x += DIRECTIONS.dx[w.direction];
+        w.y += DIRECTIONS.dy[w.direction];
+
+        int x = getFloor(w.x), y = getFloor(w.y);
+        if (x < 0 || x >= width || y < 0 || y >= height || visit(x, y)) {
+            eliminated++;
+            w.x = (int64_t)(getNextRand(rng) % width) * FIXED_ONE + FIXED_HALF;
+            w.y = (int64_t)(getNextRand(rng) % height) * FIXED_ONE + FIXED_HALF;
+        }
+    }
+
+    return eliminated;
+}
+
+// Compares the occupancy bitmap with the std::set it replaced on a 4K board.
+void benchOccupancy() {
+    {
+        size_t heapBefore = heapInUse();
+        uint64_t start = nowNs();
+        std::set<std::pair<int, int>> eaten;
+        uint64_t eliminated = walkWorms(MAX_WIDTH, MAX_HEIGHT, BENCH_STEPS, [&](int x, int y) {
+            return !eaten.insert({x, y}).second;
+        });
+        uint64_t elapsed = nowNs() - start;
+        printf("bench=occupancy_set steps=%d fields=%zu eliminated=%lu ns_per_step=%.2f mem_bytes=%zu\n",
+               BENCH_STEPS, eaten.size(), eliminated, (double)elapsed / BENCH_STEPS, heapInUse() - heapBefore);
+    }
+
+    {
+        size_t heapBefore = heapInUse();
+        uint64_t start = nowNs();
+        OccupancyBoard board{};
+        resetBoard(board, MAX_WIDTH, MAX_HEIGHT);
+        uint64_t eliminated = walkWorms(MAX_WIDTH, MAX_HEIGHT, BENCH_STEPS, [&](int x, int y) {
+            return testAndSetField(board, x, y);
+        });
+        uint64_t elapsed = nowNs() - start;
+        printf("bench=occupancy_bitmap steps=%d eliminated=%lu ns_per_step=%.2f mem_bytes=%zu board_bytes=%zu\n",
+               BENCH_STEPS, eliminated, (double)elapsed / BENCH_STEPS, heapInUse() - heapBefore,
+               boardMemoryUsage(board));
+
+        start = nowNs();
+        resetBoard(board, MAX_WIDTH, MAX_HEIGHT);
+        printf("bench=occupancy_bitmap_clear ns=%lu\n", nowNs() - start);
+    }
+}
+
+// Places the worm in the middle of a random field.
+void spawnWorm(FloatPos &pos, uint64_t &rng) {
+    pos.x = getNextRand(rng) % DEFAULT_WIDTH + 0.5;
+    pos.y = getNextRand(rng) % DEFAULT_HEIGHT + 0.5;
+}
+
+// Places the worm in the middle of a random field.
+void spawnWorm(PlayerPos &pos, uint64_t &rng) {
+    pos.x = (int64_t)(getNextRand(rng) % DEFAULT_WIDTH) * FIXED_ONE + FIXED_HALF;
+    pos.y = (int64_t)(getNextRand(rng) % DEFAULT_HEIGHT) * FIXED_ONE + FIXED_HALF;
+}
+
+// Moves the worm like updateGame did before positions became fixed-point.
+void moveWorm(FloatPos &pos, int direction) {
+    pos.x += cos(direction / 180.0 * M_PI);
+    pos.y += sin(direction / 180.0 * M_PI);
+}
+
+// Moves the worm like updateGame does.
+void moveWorm(PlayerPos &pos, int direction) {
+    pos.x += DIRECTIONS.dx[direction];
+    pos.y += DIRECTIONS.dy[direction];
+}
+
+// Returns the field the worm is in.
+std::pair<int, int> wormField(const FloatPos &pos) {
+    return {static_cast<int>(std::floor(pos.x)), static_cast<int>(std::floor(pos.y))};
+}
+
+// Returns the field the worm is in.
+std::pair<int, int> wormField(const PlayerPos &pos) {
+    return {getFloor(pos.x), getFloor(pos.y)};
+}
+
+// Simulates BENCH_MOVE_TICKS ticks of BENCH_PLAYERS randomly turning worms on the
+// default board, worms leaving it are respawned. Calls visit(worm, field) on every
+// field a worm enters and returns the number of ticks simulated per second.
+template<typename Pos, typename Visit>
+double moveWorms(Visit visit) {
+    uint64_t rng = 2021;
+    std::vector<Pos> worms(BENCH_PLAYERS);
+    std::vector<int> directions(BENCH_PLAYERS);
+    for (int i = 0; i < BENCH_PLAYERS; i++) {
+        spawnWorm(worms[i], rng);
+        directions[i] = getNextRand(rng) % 360;
+    }
+
+    uint64_t start = nowNs();
+    for (int tick = 0; tick < BENCH_MOVE_TICKS; tick++) {
+        for (int i = 0; i < BENCH_PLAYERS; i++) {
+            directions[i] = (directions[i] + (getNextRand(rng) % 3) * DEFAULT_TURNING_SPEED + 354) % 360;
+            std::pair<int, int> old = wormField(worms[i]);
+            moveWorm(worms[i], directions[i]);
+            std::pair<int, int> field = wormField(worms[i]);
+            if (field == old) {
+                continue;
+            } else if (field.first < 0 || field.first >= DEFAULT_WIDTH || field.second < 0 || field.second >= DEFAULT_HEIGHT) {
+                spawnWorm(worms[i], rng);
+            } else {
+                visit(i, field);
+            }
+        }
+    }
+
+    return BENCH_MOVE_TICKS * 1e9 / (nowNs() - start);
+}
+
+// Compares the fixed-point movement with the floating point one it replaced and
+// counts fields in which the two simulations of the same worms differ.
+void benchMovement() {
+    uint64_t checksum = 0;
+    std::vector<std::pair<int, int>> floatFields, fixedFields;
+    double floatTps = moveWorms<FloatPos>([&](int worm, std::pair<int, int> field) {
+        checksum += worm ^ field.first ^ field.second;
+    });
+    double fixedTps = moveWorms<PlayerPos>([&](int worm, std::pair<int, int> field) {
+        checksum += worm ^ field.first ^ field.second;
+    });
+    moveWorms<FloatPos>([&](int, std::pair<int, int> field) { floatFields.push_back(field); });
+    moveWorms<PlayerPos>([&](int, std::pair<int, int> field) { fixedFields.push_back(field); });
+
+    size_t same = 0;
+    while (same < std::min(floatFields.size(), fixedFields.size()) && floatFields[same] == fixedFields[same]) {
+        same++;
+    }
+
+    printf("bench=movement ticks=%d players=%d float_ticks_per_sec=%.0f fixed_ticks_per_sec=%.0f speedup=%.2f "
+           "fields=%zu fields_before_divergence=%zu checksum=%lu\n",
+           BENCH_MOVE_TICKS, BENCH_PLAYERS, floatTps, fixedTps, fixedTps / floatTps,
+           fixedFields.size(), same, checksum);
+}
+
+using Crc32Kernel = uint32_t (*)(uint32_t, const void *, size_t);
+
+// Implementations of the CRC32 state update that can run on this CPU.
+std::vector<std::pair<const char *, Crc32Kernel>> crc32Kernels() {
+    std::vector<std::pair<const char *, Crc32Kernel>> kernels = {
+            {"bytewise", crc32UpdateBytewise}, {"slicing8", crc32UpdateSlicing8}, {"dispatch", crc32Update}};
+#ifdef CRC32_HAVE_PCLMUL
+    if (crc32UsePclmul) {
+        kernels.emplace_back("pclmul", crc32UpdatePclmul);
+    }
+#endif
+    return kernels;
+}
+
+// Checks every implementation against the bytewise one on buffers of all lengths up to
+// BENCH_CRC_MAX_CHECKED at every alignment, whole and split in two updates, then measures
+// throughput of each of them.
+void benchCrc32() {
+    uint64_t rng = 1;
+    std::vector<uint8_t> buf((1 << 20) + 64);
+    for (auto &byte : buf) {
+        byte = getNextRand(rng);
+    }
+
+    auto kernels = crc32Kernels();
+    uint64_t cases = 0, mismatches = crc32("123456789", 9) != 0xCBF43926;
+    for (size_t size = 0; size <= BENCH_CRC_MAX_CHECKED; size++) {
+        for (size_t offset = 0; offset < 16; offset++) {
+            const uint8_t *p = buf.data() + offset;
+            uint32_t expected = crc32UpdateBytewise(~0U, p, size);
+            size_t split = size ? getNextRand(rng) % size : 0;
+            for (auto &kernel : kernels) {
+                cases++;
+                mismatches += kernel.second(~0U, p, size) != expected;
+                mismatches += kernel.second(kernel.second(~0U, p, split), p + split, size - split) != expected;
+            }
+        }
+    }
+    printf("bench=crc32_check kernels=%zu pclmul=%d cases=%lu mismatches=%lu\n",
+           kernels.size(), crc32UsePclmul, cases, mismatches);
+
+    for (size_t size : {16, 64, 550, 4096, 1 << 20}) {
+        for (auto &kernel : kernels) {
+            uint32_t crc = ~0U;
+            uint64_t start = nowNs();
+            for (size_t done = 0; done < BENCH_CRC_BYTES; done += size) {
+                crc = kernel.second(crc, buf.data() + done % 64, size);
+            }
+            uint64_t elapsed = nowNs() - start;
+            printf("bench=crc32_%s size=%zu mb_per_sec=%.0f ns_per_call=%.1f crc=%08x\n", kernel.first, size,
+                   BENCH_CRC_BYTES / (elapsed / 1e9) / 1e6, (double)elapsed * size / BENCH_CRC_BYTES, crc);
+        }
+    }
+}
+
+// Returns CPU time (user and system) used by the process in nanoseconds.
+uint64_t cpuNs() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL
+           + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+// Returns the peak resident set size of the process in kilobytes.
+long peakRssKb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Returns ServerParameters of a simulation with given options.
+ServerParameters simParameters(SimOptions &opts) {
+    return {1, opts.turningSpeed, DEFAULT_RPS, 0, opts.width, opts.height,
+            DEFAULT_RECV_BATCH, 1, 0, DEFAULT_RECV_THREADS, NULL,
+            NULL, DEFAULT_RECORDING_FILES, DEFAULT_RECORDING_FILE_SIZE, DEFAULT_SIM_THREADS,
+            DEFAULT_ARCHIVED_GAMES, DEFAULT_LOG_BUDGET};
+}
+
+// Seats opts.players players in a fresh game, without starting it.
+void seatPlayers(SimOptions &opts, GameState &game) {
+    game = GameState{};
+    for (int i = 0; i < opts.players; i++) {
+        ClientInfo info = {0, "player" + std::to_string(i), 0, 0, 0};
+        game.readyPlayers.insert(info);
+        game.playerPos[info] = {};
+    }
+}
+
+// Plays opts.games games with randomly turning players, each lasting until a
+// single player survives or opts.gameTicks ticks pass. Reports the cost of
+// startGame and of updateGame, returns event logs of all games.
+std::vector<std::vector<char>> benchSimulation(SimOptions &opts) {
+    ServerParameters params = simParameters(opts);
+    Room room = std::move(createRooms(params)[0]);
+    uint64_t rng = 777;
+    uint64_t startNs = 0, startAllocs = 0, tickNs = 0, tickAllocs = 0, ticks = 0, events = 0;
+    std::vector<std::vector<char>> logs;
+    for (int64_t gameNo = 0; gameNo < opts.games; gameNo++) {
+        seatPlayers(opts, room.game);
+        uint64_t allocsBefore = allocations.load(), start = nowNs();
+        startGame(params, room.game, room.rng);
+        startNs += nowNs() - start;
+        startAllocs += allocations.load() - allocsBefore;
+
+        for (int64_t tick = 0; tick < opts.gameTicks && room.game.playerPos.size() >= 2; tick++) {
+            for (auto &i : room.game.playerPos) {
+                i.second.turnDirection = getNextRand(rng) % 3;
+            }
+
+            allocsBefore = allocations.load();
+            start = nowNs();
+            updateGame(params, room.game);
+            tickNs += nowNs() - start;
+            tickAllocs += allocations.load() - allocsBefore;
+            ticks++;
+        }
+
+        events += eventCount(room.game.events);
+        logs.emplace_back();
+        copyEvents(room.game.events, 0, logs.back());
+    }
+
+    printf("bench=sim_start_game players=%ld width=%ld height=%ld games=%ld ns_per_start=%.0f "
+           "allocs_per_start=%.1f peak_rss_kb=%ld\n",
+           opts.players, opts.width, opts.height, opts.games, (double)startNs / opts.games,
+           (double)startAllocs / opts.games, peakRssKb());
+    printf("bench=sim_update_game players=%ld width=%ld height=%ld turning_speed=%ld game_ticks=%ld games=%ld "
+           "ticks=%lu events=%lu ns_per_tick=%.1f events_per_sec=%.0f allocs_per_tick=%.3f peak_rss_kb=%ld\n",
+           opts.players, opts.width, opts.height, opts.turningSpeed, opts.gameTicks, opts.games, ticks, events,
+           (double)tickNs / std::max<uint64_t>(ticks, 1), events * 1e9 / std::max<uint64_t>(startNs + tickNs, 1),
+           (double)tickAllocs / std::max<uint64_t>(ticks, 1), peakRssKb());
+    return logs;
+}
+
+// Measures encoding BENCH_ENCODED_EVENTS events with create, clearing the log
+// every game length outside of the measured time.
+template<typename Create>
+void benchEncoder(SimOptions &opts, const char *name, GameState &game, Create create) {
+    uint64_t elapsed = 0, allocs = 0;
+    for (int64_t done = 0; done < BENCH_ENCODED_EVENTS;) {
+        game.events = EventLog{};
+        int64_t count = std::min<int64_t>(BENCH_ENCODED_EVENTS - done, std::max<int64_t>(opts.gameTicks, 1));
+        uint64_t allocsBefore = allocations.load(), start = nowNs();
+        for (int64_t i = 0; i < count; i++) {
+            create(done + i);
+        }
+        elapsed += nowNs() - start;
+        allocs += allocations.load() - allocsBefore;
+        done += count;
+    }
+
+    printf("bench=encode_%s events=%d ns_per_event=%.1f events_per_sec=%.0f allocs_per_event=%.3f peak_rss_kb=%ld\n",
+           name, BENCH_ENCODED_EVENTS, (double)elapsed / BENCH_ENCODED_EVENTS,
+           BENCH_ENCODED_EVENTS * 1e9 / elapsed, (double)allocs / BENCH_ENCODED_EVENTS, peakRssKb());
+}
+
+// Measures every create*Event encoder of the server separately.
+void benchEncoders(SimOptions &opts) {
+    ServerParameters params = simParameters(opts);
+    GameState game{};
+    seatPlayers(opts, game);
+    int players = opts.players;
+    benchEncoder(opts, "new_game", game, [&](int64_t) { createNewGameEvent(params, game); });
+    benchEncoder(opts, "pixel", game, [&](int64_t i) {
+        createPixelEvent(i % players, i % opts.width, i / opts.width % opts.height, game);
+    });
+    benchEncoder(opts, "player_eliminated", game, [&](int64_t i) { createPlayerEliminatedEvent(i % players, game); });
+    benchEncoder(opts, "game_over", game, [&](int64_t) { createGameOverEvent(game); });
+}
+
+// Measures parsing of the simulated games' events by the client's parseEvents.
+void benchParseEvents(SimOptions &opts, std::vector<std::vector<char>> &logs) {
+    uint64_t elapsed = 0, allocs = 0, events = 0, bytes = 0;
+    for (auto &log : logs) {
+        ClientParameters params{};
+        uint64_t allocsBefore = allocations.load(), start = nowNs();
+        parseEvents(params, log.data(), log.size());
+        elapsed += nowNs() - start;
+        allocs += allocations.load() - allocsBefore;
+        events += params.nextExpectedEventNo + params.finished;
+        bytes += log.size();
+    }
+
+    events = std::max<uint64_t>(events, 1);
+    printf("bench=parse_events players=%ld games=%ld events=%lu bytes=%lu ns_per_event=%.1f events_per_sec=%.0f "
+           "allocs_per_event=%.2f peak_rss_kb=%ld\n",
+           opts.players, opts.games, events, bytes, (double)elapsed / events,
+           events * 1e9 / std::max<uint64_t>(elapsed, 1), (double)allocs / events, peakRssKb());
+}
+
+// Appends the datagram of given protocol starting with event from to datagram,
+// returns the number of the first event it doesn't hold.
+uint32_t packDatagram(ServerNetworkData &socks, GameState &game, uint32_t from, uint8_t protocol,
+                      std::vector<char> &datagram) {
+    datagram.assign(game.gameIdPrefix, game.gameIdPrefix + sizeof(game.gameIdPrefix));
+    if (protocol == PROTOCOL_V2) {
+        CompactPage &page = getCompactPage(socks, game, from);
+        datagram.insert(datagram.end(), page.bytes.begin(), page.bytes.end());
+        return page.to;
+    }
+
+    DatagramPage &page = getPage(socks, game, from);
+    const char *events = eventData(game.events, from);
+    datagram.insert(datagram.end(), events, events + page.size - sizeof(game.gameIdPrefix));
+    return page.to;
+}
+
+// Compares sizes of protocol v1 and v2 datagrams of simulated games, both for events
+// broadcast every tick and for a client catching up with a whole game at once. Datagrams
+// of both protocols are parsed by the client's code, which must give the same GUI events.
+void benchProtocols(SimOptions &opts) {
+    ServerParameters params = simParameters(opts);
+    ServerNetworkData socks{};
+    Room room = std::move(createRooms(params)[0]);
+    uint64_t rng = 777, events = 0;
+    uint64_t broadcastBytes[3] = {}, catchUpBytes[3] = {}, catchUpDatagrams[3] = {}, keyframeBytes = 0;
+    bool match = true;
+    std::vector<char> datagram;
+    for (int64_t gameNo = 0; gameNo < opts.games; gameNo++) {
+        seatPlayers(opts, room.game);
+        startGame(params, room.game, room.rng);
+        GameState &game = room.game;
+        uint32_t broadcastFrom = 0;
+        for (int64_t tick = 0; tick <= opts.gameTicks; tick++) {
+            for (uint8_t protocol : {PROTOCOL_V1, PROTOCOL_V2}) {
+                for (uint32_t from = broadcastFrom; from < eventCount(game.events);) {
+                    from = packDatagram(socks, game, from, protocol, datagram);
+                    broadcastBytes[protocol] += datagram.size();
+                }
+            }
+
+            broadcastFrom = eventCount(game.events);
+            if (tick == opts.gameTicks || game.playerPos.size() < 2) {
+                break;
+            }
+
+            for (auto &i : game.playerPos) {
+                i.second.turnDirection = getNextRand(rng) % 3;
+            }
+            updateGame(params, game);
+        }
+
+        ClientParameters clients[3] = {};
+        for (uint8_t protocol : {PROTOCOL_V1, PROTOCOL_V2}) {
+            for (uint32_t from = 0; from < eventCount(game.events);) {
+                from = packDatagram(socks, game, from, protocol, datagram);
+                catchUpBytes[protocol] += datagram.size();
+                catchUpDatagrams[protocol]++;
+                if (protocol == PROTOCOL_V2) {
+                    parseCompactEvents(clients[protocol], datagram.data(), datagram.size());
+                } else {
+                    parseEvents(clients[protocol], datagram.data() + 4, datagram.size() - 4);
+                }
+            }
+        }
+
+        match &= clients[PROTOCOL_V1].events == clients[PROTOCOL_V2].events
+                 && clients[PROTOCOL_V1].finished == clients[PROTOCOL_V2].finished;
+        KeyframeState kf{};
+        foldKeyframeEvents(kf, game.events, eventCount(game.events));
+        keyframeBytes += encodeKeyframe(kf).size();
+        events += eventCount(game.events);
+    }
+
+    printf("bench=protocol players=%ld width=%ld height=%ld games=%ld events=%lu "
+           "v1_broadcast_bytes_per_event=%.2f v2_broadcast_bytes_per_event=%.2f "
+           "v1_catchup_bytes_per_event=%.2f v2_catchup_bytes_per_event=%.2f "
+           "keyframe_bytes_per_event=%.2f v1_catchup_datagrams=%lu v2_catchup_datagrams=%lu decode_match=%d\n",
+           opts.players, opts.width, opts.height, opts.games, events,
+           (double)broadcastBytes[PROTOCOL_V1] / events, (double)broadcastBytes[PROTOCOL_V2] / events,
+           (double)catchUpBytes[PROTOCOL_V1] / events, (double)catchUpBytes[PROTOCOL_V2] / events,
+           (double)keyframeBytes / events, catchUpDatagrams[PROTOCOL_V1], catchUpDatagrams[PROTOCOL_V2], match);
+}
+
+// Fans out one tick of events to BENCH_PLAYERS local sockets per iteration,
+// either with a sendEvents call per client or with a single batched broadcast.
+void benchBroadcast(bool batched) {
+    ServerNetworkData socks{};
+    socks.sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    socks.metrics = std::make_unique<Metrics>();
+    std::vector<int> sinks;
+    for (int i = 0; i < BENCH_PLAYERS; i++) {
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_loopback;
+        socklen_t len = sizeof(addr);
+        int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+        if (sock == -1 || bind(sock, (sockaddr *)&addr, len) == -1 || getsockname(sock, (sockaddr *)&addr, &len) == -1) {
+            syserr("bench sink socket");
+        }
+
+        sinks.push_back(sock);
+        ClientAddr key{};
+        key.ip = addr.sin6_addr;
+        key.port = addr.sin6_port;
+        insertClient(socks.clientId, key, addr);
+    }
+
+    std::vector<Room> rooms(1);
+    GameState &game = rooms[0].game;
+    game.active = true;
+    uint64_t start = nowNs(), cpuStart = cpuNs();
+    for (int tick = 0; tick < BENCH_TICKS; tick++) {
+        uint32_t from = eventCount(game.events);
+        for (int i = 0; i < BENCH_PLAYERS; i++) {
+            createPixelEvent(i, tick, i, game);
+        }
+
+        if (batched) {
+            broadcastEvents(socks, rooms);
+        } else {
+            for (auto &slot : socks.clientId.slots) {
+                if (slot.state == SLOT_USED) {
+                    sendEvents(socks, slot.sockaddr, game, from);
+                }
+            }
+        }
+    }
+
+    uint64_t elapsed = nowNs() - start, cpu = cpuNs() - cpuStart;
+    printf("bench=%s ticks=%d clients=%d syscalls=%lu datagrams=%lu dropped=%lu ns_per_tick=%.0f cpu_ns_per_tick=%.0f\n",
+           batched ? "broadcast_sendmmsg" : "broadcast_per_client", BENCH_TICKS, BENCH_PLAYERS,
+           socks.stats.sendSyscalls, socks.stats.datagramsSent, socks.stats.datagramsDropped,
+           (double)elapsed / BENCH_TICKS, (double)cpu / BENCH_TICKS);
+
+    for (int sock : sinks) {
+        close(sock);
+    }
+    close(socks.sock);
+}
+
+// Reads BENCH_LOG_READS events of the log picked by pick in batches of BENCH_LOG_BATCH, trimming the
+// segments between batches like the server does after every wakeup. Counts events that don't have
+// their number or a valid CRC in badEvents and returns the time per read in ns.
+template<typename Pick>
+double readEventLog(SegmentStore &store, EventLog &log, uint64_t &maxResident, uint64_t &badEvents, Pick pick) {
+    uint64_t start = nowNs();
+    for (uint32_t i = 0; i < BENCH_LOG_READS; i++) {
+        uint32_t eventNo = pick();
+        const char *event = eventData(log, eventNo);
+        uint32_t len = getBigEndian(event, 4);
+        badEvents += getBigEndian(event + 4, 4) != eventNo || crc32(event, len + 4) != getBigEndian(event + 4 + len, 4);
+        if (i % BENCH_LOG_BATCH == 0) {
+            trimSegments(store);
+            maxResident = std::max(maxResident, store.resident);
+        }
+    }
+    return (double)(nowNs() - start) / BENCH_LOG_READS;
+}
+
+// Appends BENCH_LOG_EVENTS pixel events to a log under a budget of BENCH_LOG_BUDGET bytes, trimming
+// it after every batch, then reads random events of its last BENCH_LOG_TAIL events, which clients
+// usually ask for, and random events of the whole log, most of which have to be read back from disk.
+void benchEventLog() {
+    SegmentStore store{};
+    store.budget = BENCH_LOG_BUDGET;
+    store.spillFd = -1;
+    GameState game{};
+    game.events.store = &store;
+
+    uint64_t start = nowNs(), maxResident = 0;
+    for (uint32_t i = 0; i < BENCH_LOG_EVENTS; i++) {
+        createPixelEvent(i % BENCH_PLAYERS, i % DEFAULT_WIDTH, i / DEFAULT_WIDTH % DEFAULT_HEIGHT, game);
+        if (i % BENCH_LOG_BATCH == 0) {
+            settleEventLog(game.events);
+            trimSegments(store);
+            maxResident = std::max(maxResident, store.resident);
+        }
+    }
+    uint64_t appendNs = nowNs() - start, spills = store.spills;
+
+    uint64_t rng = 1, badEvents = 0;
+    uint32_t count = eventCount(game.events);
+    double tailNs = readEventLog(store, game.events, maxResident, badEvents, [&]() {
+        return count - 1 - getNextRand(rng) % BENCH_LOG_TAIL;
+    });
+    uint64_t tailPageIns = store.pageIns;
+    double randomNs = readEventLog(store, game.events, maxResident, badEvents, [&]() {
+        return getNextRand(rng) % count;
+    });
+
+    printf("bench=event_log events=%u bytes=%lu budget=%d max_resident=%lu spills=%lu ns_per_append=%.1f "
+           "tail_page_ins=%lu ns_per_tail_read=%.1f random_page_ins=%lu ns_per_random_read=%.1f bad_events=%lu "
+           "peak_rss_kb=%ld\n",
+           count, game.events.bytes, BENCH_LOG_BUDGET, maxResident, spills, (double)appendNs / count, tailPageIns,
+           tailNs, store.pageIns - tailPageIns, randomNs, badEvents, peakRssKb());
+}
+
+// Seats players in the room and starts its game.
+void startBenchGame(ServerParameters &params, Room &room, int players, SegmentStore *store) {
+    room.game = GameState{};
+    room.game.events.store = store;
+    for (int i = 0; i < players; i++) {
+        ClientInfo info = {0, "player" + std::to_string(i), 0, 0, 0};
+        room.game.readyPlayers.insert(info);
+        room.game.playerPos[info] = {};
+    }
+
+    startGame(params, room.game, room.rng);
+}
+
+// Simulates BENCH_ROOMS rooms with randomly turning players on the worker pool
+// and reports how many rooms a single core can keep up with at 50 and 250 rps.
+// With budgeted, logs of all rooms share a store of BENCH_ROOM_LOG_BUDGET bytes,
+// which is settled and trimmed after every tick like the server does.
+void benchRooms(int workers, bool budgeted) {
+    ServerParameters params = {1, DEFAULT_TURNING_SPEED, DEFAULT_RPS, 0, DEFAULT_WIDTH, DEFAULT_HEIGHT,
+                               DEFAULT_RECV_BATCH, BENCH_ROOMS, workers, DEFAULT_RECV_THREADS, NULL,
+                               NULL, DEFAULT_RECORDING_FILES, DEFAULT_RECORDING_FILE_SIZE, DEFAULT_SIM_THREADS,
+                               DEFAULT_ARCHIVED_GAMES, DEFAULT_LOG_BUDGET};
+    SegmentStore store{};
+    store.budget = BENCH_ROOM_LOG_BUDGET;
+    store.spillFd = -1;
+    SegmentStore *roomStore = budgeted ? &store : NULL;
+    std::vector<Room> rooms = createRooms(params);
+    for (auto &room : rooms) {
+        startBenchGame(params, room, BENCH_ROOM_PLAYERS, roomStore);
+    }
+
+    WorkerPool pool{};
+    startWorkers(pool, workers);
+
+    uint64_t rng = 777, roomTicks = 0;
+    std::vector<std::function<void()>> tasks;
+    uint64_t start = nowNs(), cpuStart = cpuNs();
+    for (int tick = 0; tick < BENCH_ROOM_TICKS; tick++) {
+        for (auto &room : rooms) {
+            if (room.game.playerPos.size() < 2) {
+                startBenchGame(params, room, BENCH_ROOM_PLAYERS, roomStore);
+            }
+
+            for (auto &i : room.game.playerPos) {
+                i.second.turnDirection = getNextRand(rng) % 3;
+            }
+
+            GameState &game = room.game;
+            tasks.push_back([&params, &game] { updateGame(params, game); });
+            roomTicks++;
+        }
+
+        runTasks(pool, tasks);
+        tasks.clear();
+        if (budgeted) {
+            for (auto &room : rooms) {
+                settleEventLog(room.game.events);
+            }
+            trimSegments(store);
+        }
+    }
+
+    uint64_t elapsed = nowNs() - start, cpu = cpuNs() - cpuStart;
+    double cpuPerRoomTick = (double)cpu / roomTicks;
+    printf("bench=%s workers=%d rooms=%d players=%d ticks=%d wall_ns_per_tick=%.0f cpu_ns_per_room_tick=%.1f "
+           "steals=%lu rooms_per_core_50rps=%.0f rooms_per_core_250rps=%.0f resident=%lu spills=%lu\n",
+           budgeted ? "rooms_budgeted" : "rooms", workers, BENCH_ROOMS, BENCH_ROOM_PLAYERS, BENCH_ROOM_TICKS,
+           (double)elapsed / BENCH_ROOM_TICKS, cpuPerRoomTick, pool.steals.load(), 1e9 / (50 * cpuPerRoomTick),
+           1e9 / (250 * cpuPerRoomTick), store.resident, store.spills);
+    stopWorkers(pool);
+}
+
+// Parses shell options of the benchmarks, terminates when they are incorrect.
+void getOptions(SimOptions &opts, int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:h:t:g:k:f:")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.players = getValFromOptarg(2, MAX_PLAYERS, "Invalid number of players");
+            break;
+        case 'w':
+            opts.width = getValFromOptarg(MIN_WIDTH, MAX_WIDTH, "Invalid width");
+            break;
+        case 'h':
+            opts.height = getValFromOptarg(MIN_HEIGHT, MAX_HEIGHT, "Invalid height");
+            break;
+        case 't':
+            opts.turningSpeed = getValFromOptarg(MIN_TURNING_SPEED, MAX_TURNING_SPEED, "Invalid turning speed");
+            break;
+        case 'g':
+            opts.gameTicks = getValFromOptarg(1, MAX_SIM_GAME_TICKS, "Invalid game length");
+            break;
+        case 'k':
+            opts.games = getValFromOptarg(1, MAX_SIM_GAMES, "Invalid number of games");
+            break;
+        case 'f':
+            opts.filter = optarg;
+            break;
+        default:
+            std::cerr << "Option is not supported\n";
+            exit(1);
+        }
+    }
+}
+
+// Returns whether the benchmark with given name was selected with -f.
+bool selected(SimOptions &opts, const std::string &name) {
+    return name.compare(0, opts.filter.size(), opts.filter) == 0;
+}
+
+int main(int argc, char **argv) {
+    SimOptions opts = {DEFAULT_SIM_PLAYERS, DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_TURNING_SPEED,
+                       DEFAULT_SIM_GAME_TICKS, DEFAULT_SIM_GAMES, ""};
+    getOptions(opts, argc, argv);
+
+    if (selected(opts, "sim") || selected(opts, "parse")) {
+        std::vector<std::vector<char>> logs = benchSimulation(opts);
+        if (selected(opts, "parse")) {
+            benchParseEvents(opts, logs);
+        }
+    }
+    if (selected(opts, "encode")) {
+        benchEncoders(opts);
+    }
+    if (selected(opts, "protocol")) {
+        benchProtocols(opts);
+    }
+    if (selected(opts, "occupancy")) {
+        benchOccupancy();
+    }
+    if (selected(opts, "movement")) {
+        benchMovement();
+    }
+    if (selected(opts, "crc32")) {
+        benchCrc32();
+    }
+    if (selected(opts, "broadcast")) {
+        benchBroadcast(false);
+        benchBroadcast(true);
+    }
+    if (selected(opts, "event_log")) {
+        benchEventLog();
+    }
+    if (selected(opts, "rooms")) {
+        benchRooms(0, false);
+        benchRooms(std::max(1u, std::thread::hardware_concurrency()) - 1, false);
+        benchRooms(std::max(1u, std::thread::hardware_concurrency()) - 1, true);
+    }
+}
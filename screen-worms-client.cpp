@@ -93,7 +93,7 @@ int getGuiSock() {
 void getOptions(ClientParameters &params, int argc, char **argv) {
     int opt;
     int cnt = 0;
-    while ((opt = getopt(argc, argv, "n:p:i:r:")) != -1) {
+    while ((opt = getopt(argc, argv, "n:p:i:r:v:k:")) != -1) {
         cnt += 2;
         switch (opt) {
         case 'p':
@@ -124,6 +124,14 @@ void getOptions(ClientParameters &params, int argc, char **argv) {
             params.guiName = optarg;
             break;
 
+        case 'v':
+            params.protocol = getValFromOptarg(PROTOCOL_V1, PROTOCOL_V2, "Invalid protocol version");
+            break;
+
+        case 'k':
+            params.keyframes = getValFromOptarg(0, 1, "Invalid keyframe setting");
+            break;
+
         default:
             std::cerr << "Option is not supported\n";
             exit(1);
@@ -167,7 +175,8 @@ uint64_t curTime() {
 // Creates a move message, in form that can be read by the server (big endian).
 std::string createMoveMsg(ClientParameters &params) {
     std::string res = tonStr(params.sessionId, 8);
-    res += tonStr(params.turnDirection, 1);
+    res += tonStr(params.turnDirection | (params.protocol == PROTOCOL_V2 ? PROTOCOL_V2_FLAG : 0)
+                  | (params.keyframes ? KEYFRAME_FLAG : 0), 1);
     res += tonStr(params.nextExpectedEventNo, 4);
     res += params.playerName;
     return res;
@@ -209,6 +218,89 @@ std::string createPlayerEliminatedEvent(ClientParameters &params, uint8_t player
 }
 
 
+// Parses null-terminated player names of a NEW_GAME event, terminates the client when they are invalid.
+std::vector<std::string> parsePlayerNames(const char *buf, int64_t left) {
+    std::vector<std::string> players;
+    std::string curPlayer;
+    while (left > 0) {
+        if (buf[0] == '\0' && curPlayer.empty()) {
+            syserr("valid crc but event is invalid2");
+        } else if (buf[0] == '\0') {
+            players.push_back(curPlayer);
+            curPlayer.clear();
+        } else if (buf[0] < 33 || buf[0] > 126) {
+            syserr("valid crc but event is invalid3");
+        } else {
+            curPlayer += buf[0];
+        }
+
+        left--;
+        if (left == 0 && buf[0] != '\0') {
+            syserr("valid crc but event is invalid4");
+        }
+
+        buf++;
+    }
+
+    if (players.size() < 2 || players.size() > MAX_PLAYERS || !is_sorted(players.begin(), players.end())) {
+        syserr("valid crc but event is invalid5");
+    }
+
+    auto it = std::unique(players.begin(), players.end());
+    if (it != players.end()) {
+        syserr("valid crc but event is invalid6");
+    }
+
+    return players;
+}
+
+// Updates params with a decoded NEW_GAME event, a repeated one is ignored.
+void applyNewGame(ClientParameters &params, uint32_t eventNo, uint32_t maxx, uint32_t maxy,
+                  std::vector<std::string> &players) {
+    if (eventNo != 0)
+        syserr("new game wrong eventno");
+
+    if (params.nextExpectedEventNo != 0) {
+        return;
+    }
+
+    params.events.push_back(createNewGameEvent(maxx, maxy, players));
+    params.nextExpectedEventNo++;
+    params.width = maxx;
+    params.height = maxy;
+    params.playerNames = players;
+}
+
+// Updates params with a decoded PIXEL event. Events that don't follow the client's ones are
+// dropped before they're checked, e.g. ones following a keyframe that didn't arrive whole.
+void applyPixel(ClientParameters &params, uint32_t eventNo, uint8_t playerNumber, uint32_t x, uint32_t y) {
+    if (eventNo != params.nextExpectedEventNo || params.finished) {
+        return;
+    }
+
+    params.events.push_back(createPixelEvent(params, playerNumber, x, y));
+    params.nextExpectedEventNo++;
+}
+
+// Updates params with a decoded PLAYER_ELIMINATED event.
+void applyPlayerEliminated(ClientParameters &params, uint32_t eventNo, uint8_t playerNumber) {
+    if (eventNo != params.nextExpectedEventNo || params.finished) {
+        return;
+    }
+
+    params.events.push_back(createPlayerEliminatedEvent(params, playerNumber));
+    params.nextExpectedEventNo++;
+}
+
+// Updates params with a decoded GAME_OVER event.
+void applyGameOver(ClientParameters &params, uint32_t eventNo) {
+    if (eventNo != params.nextExpectedEventNo || params.finished) {
+        return;
+    }
+
+    params.finished = 1;
+}
+
 // Parses a single event from raw form, updates params.events with it.
 int parseEvent(ClientParameters &params, char *buf, int64_t bufLen) {
     if (bufLen < MIN_EVENT_SIZE) {
@@ -256,45 +348,8 @@ int parseEvent(ClientParameters &params, char *buf, int64_t bufLen) {
             uint32_t maxy = strTon(std::string(buf, 4));
             buf += 4, left -= 4;
 
-            std::vector<std::string> players;
-            std::string curPlayer;
-            while (left > 0) {
-                if (buf[0] == '\0' && curPlayer.empty()) {
-                    syserr("valid crc but event is invalid2");
-                } else if (buf[0] == '\0') {
-                    players.push_back(curPlayer);
-                    curPlayer.clear();
-                } else if (buf[0] < 33 || buf[0] > 126) {
-                    syserr("valid crc but event is invalid3");
-                } else {
-                    curPlayer += buf[0];
-                }
-
-                left--;
-                if (left == 0 && buf[0] != '\0') {
-                    syserr("valid crc but event is invalid4");
-                }
-
-                buf++;
-            }
-
-            if (players.size() < 2 || players.size() > MAX_PLAYERS || !is_sorted(players.begin(), players.end())) {
-                syserr("valid crc but event is invalid5");
-            }
-
-            auto it = std::unique(players.begin(), players.end());
-            if (it != players.end()) {
-                syserr("valid crc but event is invalid6");
-            }
-
-            if (eventNo != 0)
-                syserr("new game wrong eventno");
-
-            params.events.push_back(createNewGameEvent(maxx, maxy, players));
-            params.nextExpectedEventNo++;
-            params.width = maxx;
-            params.height = maxy;
-            params.playerNames = players;
+            std::vector<std::string> players = parsePlayerNames(buf, left);
+            applyNewGame(params, eventNo, maxx, maxy, players);
             break;
         }
         
@@ -304,42 +359,194 @@ int parseEvent(ClientParameters &params, char *buf, int64_t bufLen) {
             uint32_t x = strTon(std::string(buf, 4));
             buf += 4;
             uint32_t y = strTon(std::string(buf, 4));
-
-            std::string event = createPixelEvent(params, playerNumber, x, y);
-            if (eventNo != params.nextExpectedEventNo || params.finished) {
-                break;
-            }
-
-            params.events.push_back(event);
-            params.nextExpectedEventNo++;
+            applyPixel(params, eventNo, playerNumber, x, y);
             break;
         }
         
         case PLAYER_ELIMINATED_EVENT: {
             uint8_t playerNumber = strTon(std::string(buf, 1));
-            std::string event = createPlayerEliminatedEvent(params, playerNumber);
-            if (eventNo != params.nextExpectedEventNo || params.finished) {
+            applyPlayerEliminated(params, eventNo, playerNumber);
+            break;
+        }
+
+        case GAME_OVER_EVENT:
+            applyGameOver(params, eventNo);
+            break;
+    
+        default:
+            break;
+    }
+
+    return len + 8;
+}
+
+// Reads a varint of a compact event, terminates the client when it's cut off.
+uint64_t getCompactField(const char *&buf, const char *end) {
+    uint64_t value;
+    if (!getVarint(buf, end, value)) {
+        syserr("valid crc but event is invalid7");
+    }
+
+    return value;
+}
+
+// Parses a whole protocol v2 datagram (starting with the game id), updates params with its events.
+void parseCompactEvents(ClientParameters &params, const char *buf, size_t len) {
+    if (len < 4 + 1 + 1 + 4 || crc32(buf, len - 4) != getBigEndian(buf + len - 4, 4)) {
+        return;
+    }
+
+    const char *end = buf + len - 4;
+    buf += 5;
+    uint32_t eventNo = getCompactField(buf, end);
+    CompactPixels last{};
+    for (; buf < end; eventNo++) {
+        uint8_t tag = *buf++;
+        uint8_t eventType = tag >> COMPACT_TYPE_SHIFT, playerNumber = tag & COMPACT_PLAYER_MASK;
+        switch (eventType) {
+            case NEW_GAME_EVENT: {
+                uint32_t maxx = getCompactField(buf, end);
+                uint32_t maxy = getCompactField(buf, end);
+                uint64_t namesLen = getCompactField(buf, end);
+                if (namesLen > (uint64_t)(end - buf)) {
+                    syserr("valid crc but event is invalid1");
+                }
+
+                std::vector<std::string> players = parsePlayerNames(buf, namesLen);
+                buf += namesLen;
+                applyNewGame(params, eventNo, maxx, maxy, players);
                 break;
             }
 
-            params.events.push_back(event);
-            params.nextExpectedEventNo++;
-            break;
-        }
+            case PIXEL_EVENT: {
+                if (playerNumber >= MAX_PLAYERS) {
+                    syserr("wrong create pixel event");
+                }
+
+                uint64_t x = getCompactField(buf, end), y = getCompactField(buf, end);
+                if (last.seen[playerNumber]) {
+                    x = last.x[playerNumber] + unzigzag(x);
+                    y = last.y[playerNumber] + unzigzag(y);
+                }
 
-        case GAME_OVER_EVENT: {
-            if (eventNo != params.nextExpectedEventNo || params.finished) {
+                last.seen[playerNumber] = true;
+                last.x[playerNumber] = x;
+                last.y[playerNumber] = y;
+                applyPixel(params, eventNo, playerNumber, x, y);
                 break;
             }
 
-            params.finished = 1;
+            case PLAYER_ELIMINATED_EVENT:
+                applyPlayerEliminated(params, eventNo, playerNumber);
+                break;
+
+            case GAME_OVER_EVENT:
+                applyGameOver(params, eventNo);
+                break;
+
+            default:
+                syserr("valid crc but event is invalid8");
         }
-    
-        default:
-            break;
     }
+}
 
-    return len + 8;
+// Expands a complete keyframe into GUI commands of the events it covers, they become
+// the client's events only when there are exactly as many of them as events covered.
+void applyKeyframe(ClientParameters &params, const std::string &payload, uint32_t events) {
+    const char *buf = payload.data(), *end = buf + payload.size();
+    uint32_t maxx = getCompactField(buf, end);
+    uint32_t maxy = getCompactField(buf, end);
+    uint64_t namesLen = getCompactField(buf, end);
+    if (namesLen > (uint64_t)(end - buf)) {
+        syserr("valid crc but keyframe is invalid");
+    }
+
+    std::vector<std::string> players = parsePlayerNames(buf, namesLen);
+    buf += namesLen;
+    uint64_t eliminated = getCompactField(buf, end);
+    EventVector commands = {createNewGameEvent(maxx, maxy, players)};
+    params.width = maxx;
+    params.height = maxy;
+    params.playerNames = players;
+
+    for (size_t player = 0; player < players.size(); player++) {
+        uint64_t runs = getCompactField(buf, end);
+        for (uint64_t run = 0; run < runs; run++) {
+            int64_t x = getCompactField(buf, end), y = getCompactField(buf, end);
+            uint64_t codes = getCompactField(buf, end);
+            if (codes > (uint64_t)(end - buf) * 8 / CHAIN_CODE_BITS) {
+                syserr("valid crc but keyframe is invalid");
+            }
+
+            size_t codeBytes = (codes * CHAIN_CODE_BITS + 7) / 8;
+            for (uint64_t i = 0; i <= codes; i++) {
+                if (i > 0) {
+                    size_t bit = (i - 1) * CHAIN_CODE_BITS;
+                    uint32_t bits = (uint8_t)buf[bit / 8];
+                    if (bit / 8 + 1 < codeBytes) {
+                        bits |= (uint8_t)buf[bit / 8 + 1] << 8;
+                    }
+
+                    uint8_t code = (bits >> (bit % 8)) & ((1 << CHAIN_CODE_BITS) - 1);
+                    x += CHAIN_DX[code];
+                    y += CHAIN_DY[code];
+                }
+                if (x < 0 || y < 0 || x >= params.width || y >= params.height) {
+                    syserr("valid crc but keyframe is invalid");
+                }
+
+                commands.push_back(createPixelEvent(params, player, x, y));
+            }
+            buf += codeBytes;
+        }
+    }
+
+    for (size_t player = 0; player < players.size(); player++) {
+        if (eliminated >> player & 1) {
+            commands.push_back(createPlayerEliminatedEvent(params, player));
+        }
+    }
+
+    if (commands.size() == events) {
+        params.events = std::move(commands);
+        params.nextExpectedEventNo = events;
+    }
+}
+
+// Parses a keyframe datagram (starting with the game id) and applies the keyframe once all
+// of its parts arrived. It's useful only until the first event of the game is received.
+void parseKeyframePart(ClientParameters &params, const char *buf, size_t len) {
+    if (len < 4 + 1 + 3 + 4 || crc32(buf, len - 4) != getBigEndian(buf + len - 4, 4) || params.nextExpectedEventNo != 0) {
+        return;
+    }
+
+    const char *end = buf + len - 4;
+    buf += 5;
+    uint64_t events = getCompactField(buf, end);
+    uint64_t part = getCompactField(buf, end);
+    uint64_t parts = getCompactField(buf, end);
+    if (events == 0 || events > UINT32_MAX || parts > MAX_KEYFRAME_PARTS || part >= parts) {
+        syserr("valid crc but keyframe is invalid");
+    }
+
+    KeyframeParts &keyframe = params.keyframe;
+    if (keyframe.events != events || keyframe.parts.size() != parts) {
+        keyframe = {(uint32_t)events, std::vector<std::string>(parts), 0};
+    }
+    if (keyframe.parts[part].empty()) {
+        keyframe.parts[part].assign(buf, end);
+        keyframe.received++;
+    }
+
+    if (keyframe.received == parts) {
+        std::string payload;
+        for (auto &slice : keyframe.parts) {
+            payload += slice;
+        }
+
+        keyframe = {};
+        applyKeyframe(params, payload, events);
+    }
 }
 
 // Parses events from raw message format, updates params with them.
@@ -362,14 +569,10 @@ void trySendMove(ClientParameters &params, NetInfo &net) {
     if (net.timer[CYCLIC].revents != POLLIN)
         syserr("timer fail");
 
-    if (!(net.timer[SERVER_SOCK].revents & POLLOUT))
-        syserr("server socket fail");
-
-    net.timer[SERVER_SOCK].revents = 0;
     uint64_t reps = 0;
     int ret;
 
-    if ((ret = read(net.timer[SERVER_SOCK].fd, &reps, sizeof(reps))) < 0) {
+    if ((ret = read(net.timer[CYCLIC].fd, &reps, sizeof(reps))) < 0) {
         syserr("timerfd broke");
     }
 
@@ -485,20 +688,33 @@ void tryGetEvents(ClientParameters &params, NetInfo &net) {
             params.nextExpectedEventNo = 0;
             params.turnDirection = 0;
             params.finished = false;
+            params.keyframe = {};
         }
 
-        parseEvents(params, buf + 4, len - 4);
+        if ((uint8_t)buf[4] == COMPACT_MARKER) {
+            parseCompactEvents(params, buf, len);
+        } else if ((uint8_t)buf[4] == KEYFRAME_MARKER) {
+            parseKeyframePart(params, buf, len);
+        } else {
+            parseEvents(params, buf + 4, len - 4);
+        }
     }
 
+    // New commands go to the GUI in a single batch, there are lots of them after a keyframe.
+    std::string commands;
     for (size_t i = nextEventNo; i < params.events.size(); i++) {
-        sendEventToGui(params.events[i], net);
+        commands += params.events[i];
+    }
+    if (!commands.empty()) {
+        sendEventToGui(commands, net);
     }
 }
 
 
+#ifndef SCREEN_WORMS_NO_MAIN
 int main(int argc, char **argv) {
     if (argc < 2 || argv[1][0] == '\0' || argv[1][0] == '-') {
-        std::cerr << "usage ./screen-worms-client game_server [-n player_name] [-p n] [-i gui_server] [-r n]\n";
+        std::cerr << "usage ./screen-worms-client game_server [-n player_name] [-p n] [-i gui_server] [-r n] [-v n] [-k n]\n";
         exit(1);
     }
 
@@ -512,6 +728,7 @@ int main(int argc, char **argv) {
     params.guiPort      = DEFAULT_GUI_PORT;
     params.playerName   = "";
     params.sessionId    = curTime();
+    params.protocol     = PROTOCOL_V1;
 
     // Update client parameters according to shell options
     getOptions(params, argc, argv);
@@ -550,4 +767,5 @@ int main(int argc, char **argv) {
         tryGetMove(params, net);
         trySendMove(params, net);
     }
-} 
\ No newline at end of file
+} 
+#endif // SCREEN_WORMS_NO_MAIN
@@ -10,6 +10,13 @@
 
 enum timer_num {CYCLIC, SERVER_SOCK, GUI_SOCK};
 
+// Parts of a keyframe received so far, it covers events [0, events).
+struct KeyframeParts {
+    uint32_t events;
+    std::vector<std::string> parts;
+    size_t received;
+};
+
 struct ClientParameters {
     char *serverName;
     int serverPort;
@@ -18,6 +25,11 @@ struct ClientParameters {
     std::string playerName;
     uint64_t sessionId;
     uint8_t turnDirection;
+    // Version of the protocol the client asks the server to use.
+    uint8_t protocol;
+    // Whether the client asks for a keyframe when joining a game.
+    bool keyframes;
+    KeyframeParts keyframe;
     uint32_t nextExpectedEventNo;
     uint32_t gameId;
 
@@ -0,0 +1,317 @@
+// Reader of game recordings made by screen-worms-server, it lists recorded games,
+// dumps events of one of them and follows recordings as they are written.
+#include "screen-worms-reader.h"
+
+#include <ctime>
+
+// Parses shell options, sets params accordingly or terminates when they are incorrect.
+void getOptions(ReaderParameters &params, int argc, char **argv) {
+    int opt;
+    int cnt = 0;
+    while ((opt = getopt(argc, argv, "g:fb")) != -1) {
+        cnt++;
+        switch (opt) {
+        case 'g':
+            cnt++;
+            params.gameSet = true;
+            params.gameId = getValFromOptarg(0, UINT32_MAX, "Invalid game id");
+            break;
+
+        case 'f':
+            params.follow = true;
+            break;
+
+        case 'b':
+            params.raw = true;
+            break;
+
+        default:
+            std::cerr << "Option is not supported\n";
+            exit(1);
+        }
+    }
+
+    if (cnt != argc - 2) {
+        std::cerr << "Invalid arguments\n";
+        exit(1);
+    }
+}
+
+// Maps the recording file with given sequence number, returns false if it doesn't exist anymore.
+bool openRecording(ReaderParameters &params, uint64_t sequence, RecordingFile &file) {
+    std::string path = recordingPath(params.dir, sequence);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        syserr("open(%s)", path.c_str());
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) == -1) {
+        syserr("fstat(%s)", path.c_str());
+    }
+
+    void *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        fatal("Can't map recording %s", path.c_str());
+    }
+    close(fd);
+
+    file = {sequence, (RecordingHeader *)map, (size_t)st.st_size};
+    RecordingHeader *header = file.header;
+    if (file.size < sizeof(RecordingHeader) || memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0
+        || header->version != RECORDING_VERSION || header->fileSize != file.size
+        || header->dataStart != sizeof(RecordingHeader) + header->indexCapacity * sizeof(RecordingEntry)) {
+        fatal("%s is not a valid recording", path.c_str());
+    }
+
+    return true;
+}
+
+// Unmaps the recording file.
+void closeRecording(RecordingFile &file) {
+    munmap(file.header, file.size);
+    file.header = NULL;
+}
+
+// Returns the index entry if it lies within the file, NULL otherwise.
+const RecordingEntry *getEntry(RecordingFile &file, uint32_t entryNo) {
+    const RecordingEntry &entry = recordingIndex(file.header)[entryNo];
+    if (entry.offset < file.header->dataStart || entry.offset + entry.size > file.size) {
+        return NULL;
+    }
+
+    return &entry;
+}
+
+// Prints the wrapped event in a single line of key=value pairs.
+void printEvent(const RecordingEntry &entry, const char *event, uint32_t len) {
+    uint32_t eventNo = getBigEndian(event + 4, 4);
+    uint8_t type = event[8];
+    printf("game=%u room=%u event=%u", entry.gameId, entry.room, eventNo);
+    if (type == NEW_GAME_EVENT && len >= 13) {
+        printf(" type=new_game width=%u height=%u players=", (uint32_t)getBigEndian(event + 9, 4),
+               (uint32_t)getBigEndian(event + 13, 4));
+        for (const char *name = event + 17; name < event + 4 + len; name += strlen(name) + 1) {
+            printf("%s%s", name == event + 17 ? "" : ",", name);
+        }
+    } else if (type == PIXEL_EVENT && len == 14) {
+        printf(" type=pixel player=%u x=%u y=%u", (uint8_t)event[9], (uint32_t)getBigEndian(event + 10, 4),
+               (uint32_t)getBigEndian(event + 14, 4));
+    } else if (type == PLAYER_ELIMINATED_EVENT && len == 6) {
+        printf(" type=player_eliminated player=%u", (uint8_t)event[9]);
+    } else if (type == GAME_OVER_EVENT && len == 5) {
+        printf(" type=game_over");
+    } else {
+        printf(" type=%u len=%u", type, len);
+    }
+    printf("\n");
+}
+
+// Returns the size of the wrapped event at offset of the chunk, or 0 when the rest of
+// the chunk is malformed, which is reported.
+uint32_t chunkEventSize(const RecordingEntry &entry, const char *chunk, uint32_t offset) {
+    uint32_t len = getBigEndian(chunk + offset, 4);
+    if (len < 5 || (uint64_t)offset + len + 8 > entry.size) {
+        fprintf(stderr, "game %u: malformed chunk of events %u-%u\n", entry.gameId, entry.firstEvent,
+                entry.firstEvent + entry.events - 1);
+        return 0;
+    }
+
+    return len + 8;
+}
+
+// Writes or prints events of the chunk, reports chunks that don't follow the previous
+// chunk of their game and events with invalid CRCs. Returns true if the game is over.
+bool readChunk(ReaderParameters &params, RecordingFile &file, const RecordingEntry &entry,
+               std::unordered_map<uint32_t, uint32_t> &nextEvent) {
+    const char *chunk = (const char *)file.header + entry.offset;
+    if (params.raw) {
+        fwrite(chunk, 1, entry.size, stdout);
+    }
+
+    auto next = nextEvent.find(entry.gameId);
+    if (next != nextEvent.end() && next->second != entry.firstEvent) {
+        fprintf(stderr, "game %u: events %u-%u are missing from the recording\n", entry.gameId, next->second,
+                entry.firstEvent - 1);
+    }
+    nextEvent[entry.gameId] = entry.firstEvent + entry.events;
+
+    bool over = false;
+    for (uint32_t offset = 0, size; offset + MIN_EVENT_SIZE <= entry.size; offset += size) {
+        if ((size = chunkEventSize(entry, chunk, offset)) == 0) {
+            break;
+        }
+
+        const char *event = chunk + offset;
+        uint32_t len = size - 8;
+        if (crc32(event, len + 4) != getBigEndian(event + 4 + len, 4)) {
+            fprintf(stderr, "game %u: bad CRC of event %u\n", entry.gameId, (uint32_t)getBigEndian(event + 4, 4));
+        } else if (!params.raw) {
+            printEvent(entry, event, len);
+        }
+
+        over |= event[8] == GAME_OVER_EVENT;
+    }
+
+    return over;
+}
+
+// Reads the selected chunks among entries [from, published) of the file, returns
+// the number of entries read and sets over if the selected game is over.
+uint32_t readEntries(ReaderParameters &params, RecordingFile &file, uint32_t from,
+                     std::unordered_map<uint32_t, uint32_t> &nextEvent, bool &over) {
+    uint32_t published = std::min(__atomic_load_n(&file.header->indexCount, __ATOMIC_ACQUIRE),
+                                  file.header->indexCapacity);
+    for (uint32_t i = from; i < published; i++) {
+        const RecordingEntry *entry = getEntry(file, i);
+        if (entry == NULL) {
+            fatal("Recording %lu has an invalid index", file.sequence);
+        }
+        if (!params.gameSet || entry->gameId == params.gameId) {
+            over |= readChunk(params, file, *entry, nextEvent) && params.gameSet;
+        }
+    }
+
+    fflush(stdout);
+    return published;
+}
+
+// Returns the sequence number of the oldest recording file after given one, waits
+// for it to appear when following, returns 0 if there is none.
+uint64_t nextRecording(ReaderParameters &params, uint64_t sequence) {
+    while (true) {
+        for (uint64_t next : listRecordings(params.dir)) {
+            if (next > sequence) {
+                return next;
+            }
+        }
+
+        if (!params.follow) {
+            return 0;
+        }
+        usleep(READER_POLL_MS * 1000);
+    }
+}
+
+// Returns whether there is a recording file newer than the given one. The given one won't
+// grow anymore then, even if it isn't closed because the server writing it crashed.
+bool newerRecordingExists(ReaderParameters &params, uint64_t sequence) {
+    std::vector<uint64_t> sequences = listRecordings(params.dir);
+    return !sequences.empty() && sequences.back() > sequence;
+}
+
+// Reads chunks of all recording files starting from the given one, when following it
+// waits for chunks that aren't written yet until the selected game is over.
+void readRecordings(ReaderParameters &params, uint64_t sequence, bool skipWritten) {
+    std::unordered_map<uint32_t, uint32_t> nextEvent;
+    bool over = false;
+    RecordingFile file{};
+    while (sequence != 0 && !over) {
+        if (!openRecording(params, sequence, file)) {
+            sequence = nextRecording(params, sequence);
+            continue;
+        }
+
+        uint32_t entryNo = 0;
+        if (skipWritten) {
+            entryNo = std::min(__atomic_load_n(&file.header->indexCount, __ATOMIC_ACQUIRE), file.header->indexCapacity);
+            skipWritten = false;
+        }
+
+        while (true) {
+            bool closed = __atomic_load_n(&file.header->closed, __ATOMIC_ACQUIRE)
+                          || (params.follow && newerRecordingExists(params, sequence));
+            entryNo = readEntries(params, file, entryNo, nextEvent, over);
+            if (over || closed || !params.follow) {
+                break;
+            }
+            usleep(READER_POLL_MS * 1000);
+        }
+
+        closeRecording(file);
+        sequence = over ? 0 : nextRecording(params, sequence);
+    }
+}
+
+// Formats wall clock time given in ms.
+std::string formatTime(uint64_t ms) {
+    time_t seconds = ms / 1000;
+    tm local{};
+    localtime_r(&seconds, &local);
+    char buf[64];
+    size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &local);
+    snprintf(buf + len, sizeof(buf) - len, ".%03lu", ms % 1000);
+    return buf;
+}
+
+// Prints a line of key=value pairs for every recorded game, in order of their starts.
+void listGames(ReaderParameters &params) {
+    std::map<uint32_t, RecordedGame> games;
+    std::vector<std::pair<uint64_t, uint32_t>> starts;
+    for (uint64_t sequence : listRecordings(params.dir)) {
+        RecordingFile file{};
+        if (!openRecording(params, sequence, file)) {
+            continue;
+        }
+
+        uint32_t published = std::min(__atomic_load_n(&file.header->indexCount, __ATOMIC_ACQUIRE),
+                                      file.header->indexCapacity);
+        for (uint32_t i = 0; i < published; i++) {
+            const RecordingEntry *entry = getEntry(file, i);
+            if (entry == NULL) {
+                fatal("Recording %lu has an invalid index", sequence);
+            }
+
+            auto it = games.find(entry->gameId);
+            if (it == games.end()) {
+                it = games.insert({entry->gameId, {entry->room, 0, entry->timeMs, 0, sequence, 0, false}}).first;
+                starts.push_back({entry->timeMs, entry->gameId});
+            }
+
+            RecordedGame &game = it->second;
+            const char *chunk = (const char *)file.header + entry->offset;
+            for (uint32_t offset = 0, size; offset + MIN_EVENT_SIZE <= entry->size; offset += size) {
+                if ((size = chunkEventSize(*entry, chunk, offset)) == 0) {
+                    break;
+                }
+                game.over |= chunk[offset + 8] == GAME_OVER_EVENT;
+            }
+            game.events += entry->events;
+            game.lastMs = entry->timeMs;
+            game.lastFile = sequence;
+        }
+
+        closeRecording(file);
+    }
+
+    std::sort(starts.begin(), starts.end());
+    for (auto &start : starts) {
+        RecordedGame &game = games[start.second];
+        printf("game=%u room=%u events=%u over=%d start=%s seconds=%.1f files=%lu-%lu\n", start.second,
+               game.room, game.events, game.over, formatTime(game.firstMs).c_str(),
+               (game.lastMs - game.firstMs) / 1000.0, game.firstFile, game.lastFile);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '\0' || argv[1][0] == '-') {
+        std::cerr << "usage ./screen-worms-reader recording_dir [-g game_id] [-f] [-b]\n";
+        exit(1);
+    }
+
+    ReaderParameters params{};
+    params.dir = argv[1];
+    getOptions(params, argc, argv);
+
+    std::vector<uint64_t> sequences = listRecordings(params.dir);
+    if (!params.gameSet && !params.follow) {
+        listGames(params);
+    } else if (params.gameSet) {
+        readRecordings(params, sequences.empty() ? nextRecording(params, 0) : sequences.front(), false);
+    } else {
+        readRecordings(params, sequences.empty() ? nextRecording(params, 0) : sequences.back(), true);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef SCREEN_WORMS_READER_H
+#define SCREEN_WORMS_READER_H
+
+#include "recording.h"
+
+// Time (in ms) between checks for new chunks while following a recording.
+#define READER_POLL_MS 50
+
+struct ReaderParameters {
+    char *dir;
+    // Only events of game gameId are read when gameSet.
+    bool gameSet;
+    uint32_t gameId;
+    // Waits for new events instead of stopping at the end of the recording.
+    bool follow;
+    // Writes wrapped events as they were sent to clients instead of their text form.
+    bool raw;
+};
+
+// Recording file mapped read-only as a whole.
+struct RecordingFile {
+    uint64_t sequence;
+    RecordingHeader *header;
+    size_t size;
+};
+
+// Summary of a game listed from the recording.
+struct RecordedGame {
+    uint32_t room;
+    uint32_t events;
+    uint64_t firstMs, lastMs;
+    uint64_t firstFile, lastFile;
+    bool over;
+};
+
+#endif //SCREEN_WORMS_READER_H
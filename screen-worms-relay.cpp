@@ -0,0 +1,207 @@
+// Relay following a game server as a single spectator and serving its events to any number
+// of its own spectators with the server's protocol, so relays can be chained.
+#define SCREEN_WORMS_NO_MAIN
+#include "screen-worms-server.cpp"
+#include "screen-worms-client.cpp"
+#include "screen-worms-relay.h"
+
+// Parses shell options, sets params accordingly or terminates when they are incorrect.
+void getOptions(RelayParameters &params, int argc, char **argv) {
+    int opt;
+    int cnt = 0;
+    while ((opt = getopt(argc, argv, "p:l:b:")) != -1) {
+        cnt += 2;
+        switch (opt) {
+        case 'p':
+            params.serverPort = getValFromOptarg(0, MAX_PORT, "Invalid server port");
+            break;
+
+        case 'l':
+            params.port = getValFromOptarg(0, MAX_PORT, "Invalid port");
+            break;
+
+        case 'b':
+            params.recvBatch = getValFromOptarg(MIN_RECV_BATCH, MAX_RECV_BATCH, "Invalid receive batch size");
+            break;
+
+        default:
+            std::cerr << "Option is not supported\n";
+            exit(1);
+        }
+    }
+
+    if (cnt != argc - 2) {
+        std::cerr << "Invalid arguments\n";
+        exit(1);
+    }
+}
+
+// Opens the upstream socket and the timer of requests sent every MSG_FREQUENCY ms.
+void setupUpstream(RelayParameters &params, Upstream &up) {
+    std::string port = std::to_string(params.serverPort);
+    up.serverAddr = getSockaddr(params.serverName, &port[0], SOCK_DGRAM);
+    up.sock = getServerSock();
+    up.params.sessionId = curTime();
+    up.params.protocol = PROTOCOL_V1;
+
+    if ((up.requestTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+        syserr("timerfd_create()");
+    }
+
+    itimerspec ts{};
+    ts.it_interval.tv_nsec = ts.it_value.tv_nsec = MSG_FREQUENCY * 1000000;
+    if (timerfd_settime(up.requestTimer, 0, &ts, NULL) < 0) {
+        syserr("timerfd_settime()");
+    }
+}
+
+// Asks upstream for events following the local log, which also keeps the relay's session alive.
+void requestEvents(Upstream &up, GameState &game) {
+    uint64_t trash;
+    read(up.requestTimer, &trash, sizeof(trash));
+
+    up.params.nextExpectedEventNo = game.active ? eventCount(game.events) : 0;
+    std::string msg = createMoveMsg(up.params);
+    if (sendto(up.sock, msg.c_str(), msg.size(), 0, (sockaddr *)&up.serverAddr, sizeof(up.serverAddr)) == -1
+        && errno != EAGAIN && errno != ECONNREFUSED) {
+        syserr("sendto");
+    }
+}
+
+// Replaces the relayed game with a new one and archives the previous one, spectators
+// switch to the new game once they have all events of the previous one.
+void startRelayedGame(ServerParameters &params, ServerNetworkData &socks, Upstream &up, Room &room, uint32_t gameId) {
+    GameState &game = room.game;
+    if (game.active) {
+        fprintf(stderr, "relay: game=%u events=%u sessions=%zu upstream_datagrams=%lu upstream_events=%lu "
+                        "bad_datagrams=%lu\n", game.gameId, eventCount(game.events), socks.clientId.size,
+                up.stats.datagrams, up.stats.events, up.stats.badDatagrams);
+        printStats(socks);
+        up.previousGameId = game.gameId;
+        game.active = false;
+        archiveGame(params, room);
+    }
+
+    setGameId(room.game, gameId);
+    room.game.active = true;
+    room.game.events.store = socks.logStore.get();
+    up.stats.games++;
+}
+
+// Appends events of an upstream datagram that directly follow the local log, returns
+// true if there were any. Only a datagram starting with the first event of a game
+// other than the current and the previous one starts a new log.
+bool handleUpstreamDatagram(ServerParameters &params, ServerNetworkData &socks, Upstream &up, Room &room,
+                            const char *buf, ssize_t len) {
+    up.stats.datagrams++;
+    if (len < 4 + MIN_EVENT_SIZE) {
+        up.stats.badDatagrams++;
+        return false;
+    }
+
+    GameState &game = room.game;
+    uint32_t gameId = getBigEndian(buf, 4);
+    if (!game.active || gameId != game.gameId) {
+        if ((game.active && gameId == up.previousGameId) || getBigEndian(buf + 8, 4) != 0) {
+            return false;
+        }
+        startRelayedGame(params, socks, up, room, gameId);
+    }
+
+    uint32_t before = eventCount(game.events);
+    for (ssize_t offset = 4; offset + MIN_EVENT_SIZE <= len;) {
+        uint32_t eventLen = getBigEndian(buf + offset, 4);
+        if ((uint64_t)offset + eventLen + 8 > (uint64_t)len || eventLen < 5
+            || crc32(buf + offset, eventLen + 4) != getBigEndian(buf + offset + 4 + eventLen, 4)) {
+            up.stats.badDatagrams++;
+            break;
+        }
+
+        if (getBigEndian(buf + offset + 4, 4) == eventCount(game.events)) {
+            appendEvent(game.events, buf + offset, eventLen + 8);
+        }
+        offset += eventLen + 8;
+    }
+
+    up.stats.events += eventCount(game.events) - before;
+    return eventCount(game.events) > before;
+}
+
+// Reads all datagrams waiting on the upstream socket and broadcasts new events to spectators.
+void handleUpstream(ServerParameters &params, ServerNetworkData &socks, Upstream &up, std::vector<Room> &rooms) {
+    char buf[MAX_EVENT_SIZE];
+    ssize_t len;
+    bool appended = false;
+    while ((len = recv(up.sock, buf, MAX_EVENT_SIZE, MSG_DONTWAIT)) >= 0) {
+        appended |= handleUpstreamDatagram(params, socks, up, rooms[0], buf, len);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED) {
+        syserr("recv");
+    }
+
+    if (appended) {
+        broadcastEvents(socks, rooms);
+    }
+}
+
+// Reads a batch of messages from spectators and answers them like the server does.
+// Nobody can play through the relay, so clients with player names are spectators too.
+void handleDownstream(ServerParameters &params, ServerNetworkData &socks, std::vector<Room> &rooms) {
+    RecvBatch &batch = socks.recv;
+    int count = receiveBatch(params, socks.sock, batch, MSG_DONTWAIT);
+    socks.stats.recvSyscalls++;
+    if (count <= 0) {
+        return;
+    }
+
+    socks.stats.datagramsReceived += count;
+    addMetric(socks.metrics->packetsIn, count);
+    addMetric(socks.metrics->bytesIn, batchBytes(batch.msgs.data(), count));
+    for (int i = 0; i < count; i++) {
+        ClientInput input;
+        if (parseClientInput(batch.addrs[i], &batch.bufs[i * MAX_EVENT_SIZE], batch.msgs[i].msg_len, input)) {
+            input.msg.playerName.clear();
+            handleClientInput(socks, rooms, input);
+        } else {
+            addMetric(socks.metrics->rejectedInputs, 1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '\0' || argv[1][0] == '-') {
+        std::cerr << "usage ./screen-worms-relay game_server [-p n] [-l n] [-b n]\n";
+        exit(1);
+    }
+
+    RelayParameters relayParams{argv[1], DEFAULT_SERVER_PORT, DEFAULT_RELAY_PORT, DEFAULT_RECV_BATCH};
+    getOptions(relayParams, argc, argv);
+
+    // Spectators are served by the server's code, from a single room holding the relayed game.
+    ServerParameters params = {0, DEFAULT_TURNING_SPEED, DEFAULT_RPS, relayParams.port, DEFAULT_WIDTH,
+                               DEFAULT_HEIGHT, relayParams.recvBatch, 1, 0, 0, NULL,
+                               NULL, DEFAULT_RECORDING_FILES, DEFAULT_RECORDING_FILE_SIZE, DEFAULT_SIM_THREADS,
+                               DEFAULT_ARCHIVED_GAMES, DEFAULT_LOG_BUDGET};
+    ServerNetworkData socks{};
+    socks = setupSockets(params);
+    std::vector<Room> rooms(1);
+
+    Upstream up{};
+    setupUpstream(relayParams, up);
+
+    Reactor reactor = createReactor();
+    addHandler(reactor, socks.sock, EPOLLIN, [&](uint32_t) {
+        handleDownstream(params, socks, rooms);
+    });
+    addHandler(reactor, up.sock, EPOLLIN, [&](uint32_t) {
+        handleUpstream(params, socks, up, rooms);
+    });
+    addHandler(reactor, up.requestTimer, EPOLLIN | EPOLLET, [&](uint32_t) {
+        requestEvents(up, rooms[0].game);
+    });
+
+    while (true) {
+        handlePollEvent(socks, reactor, rooms);
+    }
+}
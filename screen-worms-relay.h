@@ -0,0 +1,32 @@
+#ifndef SCREEN_WORMS_RELAY_H
+#define SCREEN_WORMS_RELAY_H
+
+#include "screen-worms-server.h"
+#include "screen-worms-client.h"
+
+#define DEFAULT_RELAY_PORT 2022
+
+struct RelayParameters {
+    char *serverName;
+    int serverPort;
+    // Port the relay serves its own spectators on.
+    int64_t port;
+    int64_t recvBatch;
+};
+
+struct UpstreamStats {
+    uint64_t datagrams, events, badDatagrams, games;
+};
+
+// Connection of the relay to the server (or to another relay), followed as a single spectator.
+struct Upstream {
+    sockaddr_in6 serverAddr;
+    int sock, requestTimer;
+    // Parameters of the spectator's move messages, as sent by screen-worms-client.
+    ClientParameters params;
+    // Game replaced by the current one, late datagrams of it are ignored.
+    uint32_t previousGameId;
+    UpstreamStats stats;
+};
+
+#endif //SCREEN_WORMS_RELAY_H
@@ -4,7 +4,7 @@
 void getOptions(int argc, char **argv, ServerParameters &params) {
     int opt;
     int cnt = 0;
-    while ((opt = getopt(argc, argv, "p:s:t:v:w:h:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:s:t:v:w:h:b:r:j:n:m:o:k:z:g:a:e:")) != -1) {
         cnt += 2;
         switch (opt) {
         case 'p':
@@ -25,6 +25,39 @@ void getOptions(int argc, char **argv, ServerParameters &params) {
         case 'h':
             params.height = getValFromOptarg(MIN_HEIGHT, MAX_HEIGHT, "Invalid height");
             break;
+        case 'b':
+            params.recvBatch = getValFromOptarg(MIN_RECV_BATCH, MAX_RECV_BATCH, "Invalid receive batch size");
+            break;
+        case 'r':
+            params.rooms = getValFromOptarg(MIN_ROOMS, MAX_ROOMS, "Invalid number of rooms");
+            break;
+        case 'j':
+            params.workers = getValFromOptarg(MIN_WORKERS, MAX_WORKERS, "Invalid number of workers");
+            break;
+        case 'n':
+            params.recvThreads = getValFromOptarg(MIN_RECV_THREADS, MAX_RECV_THREADS, "Invalid number of receive threads");
+            break;
+        case 'm':
+            params.metricsPath = optarg;
+            break;
+        case 'o':
+            params.recordingDir = optarg;
+            break;
+        case 'k':
+            params.recordingFiles = getValFromOptarg(MIN_RECORDING_FILES, MAX_RECORDING_FILES, "Invalid number of recording files");
+            break;
+        case 'z':
+            params.recordingFileSize = getValFromOptarg(MIN_RECORDING_FILE_SIZE, MAX_RECORDING_FILE_SIZE, "Invalid recording file size");
+            break;
+        case 'g':
+            params.simThreads = getValFromOptarg(MIN_SIM_THREADS, MAX_SIM_THREADS, "Invalid number of simulation threads");
+            break;
+        case 'a':
+            params.archivedGames = getValFromOptarg(MIN_ARCHIVED_GAMES, MAX_ARCHIVED_GAMES, "Invalid number of archived games");
+            break;
+        case 'e':
+            params.logBudget = getValFromOptarg(MIN_LOG_BUDGET, MAX_LOG_BUDGET, "Invalid event log budget");
+            break;
         default:
             std::cerr << "Option is not supported\n";
             exit(1);
@@ -37,80 +70,207 @@ void getOptions(int argc, char **argv, ServerParameters &params) {
     }
 }
 
-// Resets the game timer to default settings.
-void resetGameTimer(ServerParameters &params, ServerNetworkData &socks) {
+// Returns the timespec of a time given in ns.
+timespec nsToTimespec(uint64_t ns) {
+    return {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+}
+
+// Returns current monotonic time in nanoseconds.
+uint64_t monotonicNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Resets the game timer to default settings, or stops it when no game is played.
+// The timer is set with absolute times, so that due times of its expirations are known exactly.
+void resetGameTimer(ServerParameters &params, TickLoop &loop, bool armed) {
     uint64_t trash;
-    read(socks.client[GAME_TIMER_ID].fd, &trash, sizeof(trash));
+    read(loop.timer, &trash, sizeof(trash));
+
+    itimerspec ts{};
+    if (armed) {
+        loop.periodNs = 1000000000 / params.rps;
+        loop.armedNs = monotonicNs();
+        loop.expirations = 0;
+        ts.it_interval = nsToTimespec(loop.periodNs);
+        ts.it_value = nsToTimespec(loop.armedNs + loop.periodNs);
+    }
 
-    itimerspec ts;
-    ts.it_interval.tv_sec = (params.rps == 1 ? 1 : 0);
-    ts.it_interval.tv_nsec = (params.rps == 1 ? 0 : (1000000000 / params.rps));
-    ts.it_value.tv_sec = (params.rps == 1 ? 1 : 0);
-    ts.it_value.tv_nsec = (params.rps == 1 ? 0 : (1000000000 / params.rps));
+    loop.armed = armed;
 
-    if (timerfd_settime(socks.client[GAME_TIMER_ID].fd, 0, &ts, NULL) < 0) {
+    if (timerfd_settime(loop.timer, armed ? TFD_TIMER_ABSTIME : 0, &ts, NULL) < 0) {
         syserr("timerfd_settime()");
     }
 }
 
-// Returns ServerNetworkData with sockets that are ready for connections with clients.
-ServerNetworkData setupSockets(ServerParameters &params) {
-    ServerNetworkData result{};
-    result.client[0].fd = -1;
-    result.client[0].events = POLLIN;
-    result.client[0].revents = 0;
+// Returns current wall clock time in milliseconds.
+uint64_t realtimeMs() {
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Returns current monotonic time in milliseconds.
+uint64_t monotonicMs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Returns current monotonic time in microseconds.
+uint64_t monotonicUs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Adds n to a metric counter.
+void addMetric(std::atomic<uint64_t> &counter, uint64_t n) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Sets the current value of a metric gauge.
+void setMetric(std::atomic<uint64_t> &gauge, uint64_t value) {
+    gauge.store(value, std::memory_order_relaxed);
+}
+
+// Records a single value in the histogram.
+void observeMetric(Histogram &histogram, uint64_t value) {
+    int bucket = value ? std::min(64 - __builtin_clzll(value), METRIC_BUCKETS - 1) : 0;
+    histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    histogram.sum.fetch_add(value, std::memory_order_relaxed);
+}
 
-    result.client[0].fd = socket(AF_INET6, SOCK_DGRAM, 0);
-    if (result.client[0].fd == -1)
+// Returns the total size of datagrams received or sent by a batch of count mmsghdrs.
+uint64_t batchBytes(const mmsghdr *msgs, int count) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        bytes += msgs[i].msg_len;
+    }
+    return bytes;
+}
+
+// Returns a new UDP socket bound to server's address, whose port is updated when it was 0.
+// Sockets of receive threads share the port with SO_REUSEPORT and block on reads.
+int openServerSocket(sockaddr_in6 &server, bool reusePort) {
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock == -1)
         syserr("Opening input socket");
 
-    timeval tv {};
-    tv.tv_sec = 0;
-    tv.tv_usec = 10;
-    if (setsockopt(result.client[0].fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0) {
-        syserr("setsockopt");
+    if (!reusePort) {
+        timeval tv {};
+        tv.tv_sec = 0;
+        tv.tv_usec = 10;
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0) {
+            syserr("setsockopt");
+        }
+    } else {
+        int yes = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+            syserr("setsockopt");
+        }
     }
+
     int no = 0;
-    setsockopt(result.client[0].fd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no, sizeof(no));
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no, sizeof(no));
 
-    result.server.sin6_family = AF_INET6;
-    result.server.sin6_addr = in6addr_any;
-    result.server.sin6_port = htons(params.portNum);
-    if (bind(result.client[0].fd, (sockaddr *)&(result.server), (socklen_t)sizeof(result.server)) < 0) {
+    if (bind(sock, (sockaddr *)&server, (socklen_t)sizeof(server)) < 0) {
         syserr("Binding central socket");
     }
 
-    size_t length = sizeof(result.server);
-    if (getsockname (result.client[0].fd, (sockaddr*)&(result.server), (socklen_t*)&length) == -1) {
+    size_t length = sizeof(server);
+    if (getsockname (sock, (sockaddr*)&server, (socklen_t*)&length) == -1) {
         syserr("Getting socket name");
     }
 
-    for (int i = 1; i <= MAX_PLAYERS; i++) {
-        result.freeTimerIds.insert(i);
-        if ((result.client[i].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
-            syserr("timerfd_create()");
-        }
+    return sock;
+}
+
+// Allocates buffers for reading batches of params.recvBatch datagrams.
+void setupRecvBatch(ServerParameters &params, RecvBatch &batch) {
+    batch.bufs.resize(params.recvBatch * MAX_EVENT_SIZE);
+    batch.addrs.resize(params.recvBatch);
+    batch.iovs.resize(params.recvBatch);
+    batch.msgs.resize(params.recvBatch);
+}
+
+// Allocates the queue's buffer of given (power of two) capacity.
+template<typename T>
+void initQueue(SpscQueue<T> &queue, size_t capacity) {
+    queue.items.resize(capacity);
+}
 
-        result.client[i].events = POLLIN;
-        result.client[i].revents = 0;
+// Pushes item to the queue, returns false if it's full. Called only by the producer.
+template<typename T>
+bool pushQueue(SpscQueue<T> &queue, T &&item) {
+    size_t tail = queue.tail.load(std::memory_order_relaxed);
+    if (tail - queue.head.load(std::memory_order_acquire) == queue.items.size()) {
+        return false;
     }
 
-    if ((result.client[GAME_TIMER_ID].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+    queue.items[tail & (queue.items.size() - 1)] = std::move(item);
+    queue.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+// Pops the oldest item from the queue, returns false if it's empty. Called only by the consumer.
+template<typename T>
+bool popQueue(SpscQueue<T> &queue, T &item) {
+    size_t head = queue.head.load(std::memory_order_relaxed);
+    if (head == queue.tail.load(std::memory_order_acquire)) {
+        return false;
+    }
+
+    item = std::move(queue.items[head & (queue.items.size() - 1)]);
+    queue.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// Returns a tick loop with a stopped game timer, started at given time.
+TickLoop createTickLoop(uint64_t nowMs) {
+    TickLoop loop{};
+    if ((loop.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
         syserr("timerfd_create()");
     }
 
-    itimerspec ts;
-    ts.it_interval.tv_sec = 0;
-    ts.it_interval.tv_nsec = 0;
-    ts.it_value.tv_nsec = 0;
-    ts.it_value.tv_sec = 0;
+    loop.startMs = loop.lastReport.timeMs = nowMs;
+    return loop;
+}
 
-    if (timerfd_settime(result.client[GAME_TIMER_ID].fd, 0, &ts, NULL) < 0) {
-        syserr("timerfd_settime()");
+// Returns ServerNetworkData with sockets that are ready for connections with clients.
+ServerNetworkData setupSockets(ServerParameters &params) {
+    ServerNetworkData result{};
+    result.server.sin6_family = AF_INET6;
+    result.server.sin6_addr = in6addr_any;
+    result.server.sin6_port = htons(params.portNum);
+
+    if (params.recvThreads == 0) {
+        result.sock = openServerSocket(result.server, false);
+        setupRecvBatch(params, result.recv);
+    } else {
+        for (int64_t i = 0; i < params.recvThreads; i++) {
+            auto shard = std::make_unique<RecvShard>();
+            shard->sock = openServerSocket(result.server, true);
+            setupRecvBatch(params, shard->batch);
+            initQueue(shard->inputs, INPUT_QUEUE_SIZE);
+            result.shards.push_back(std::move(shard));
+        }
+
+        result.sock = result.shards[0]->sock;
+        if ((result.inputEvent = eventfd(0, EFD_NONBLOCK)) == -1) {
+            syserr("eventfd()");
+        }
     }
 
-    result.client[GAME_TIMER_ID].events = POLLIN;
-    result.client[GAME_TIMER_ID].revents = 0;
+    result.metrics = std::make_unique<Metrics>();
+    result.wheel.slots.resize(WHEEL_SLOTS);
+    result.now = monotonicMs();
+    result.wheel.tick = result.now / WHEEL_TICK;
+    result.tickLoop = createTickLoop(result.now);
+    result.logStore = std::make_unique<SegmentStore>();
+    result.logStore->budget = (uint64_t)params.logBudget << 20;
+    result.logStore->spillFd = -1;
     return result;
 }
 
@@ -132,7 +292,9 @@ int parseClientMsg(char *buf, ssize_t len, ClientMsg &msg) {
         msg.sessionId = (msg.sessionId << 8) + (uint8_t)buf[i];
     }
 
-    msg.turnDirection = +(uint8_t)buf[8];
+    msg.turnDirection = +(uint8_t)buf[8] & ~(PROTOCOL_V2_FLAG | KEYFRAME_FLAG);
+    msg.protocol = ((uint8_t)buf[8] & PROTOCOL_V2_FLAG) ? PROTOCOL_V2 : PROTOCOL_V1;
+    msg.keyframes = (uint8_t)buf[8] & KEYFRAME_FLAG;
 
     if (msg.turnDirection > 2) {
         return 1;
@@ -154,418 +316,2435 @@ int parseClientMsg(char *buf, ssize_t len, ClientMsg &msg) {
     return 0;
 }
 
-// Returns ClientAddr struct with data from clientAddress minding if it uses IPv4 or IPv6.
-ClientAddr getClientAddr(sockaddr_storage &clientAddress) {
-    ClientAddr ret{};
-    char clientIp[INET6_ADDRSTRLEN + 5];
+// Fills addr and sockaddr with address from clientAddress minding if it uses IPv4 or IPv6,
+// returns false when it uses some other family.
+bool getClientAddr(const sockaddr_storage &clientAddress, ClientAddr &addr, sockaddr_in6 &sockaddr) {
+    sockaddr = {};
+    sockaddr.sin6_family = AF_INET6;
     switch (clientAddress.ss_family) {
         case AF_INET: {
-            sockaddr_in clientAddressIPv4 = *reinterpret_cast<sockaddr_in*>(&clientAddress);
-            inet_ntop(AF_INET, &(clientAddressIPv4.sin_addr), clientIp, sizeof(clientIp));
-            ret.port = ntohs(clientAddressIPv4.sin_port);
-            ret.ip = std::string(clientIp);
-            ret.family = AF_INET;
+            const sockaddr_in *clientAddressIPv4 = reinterpret_cast<const sockaddr_in*>(&clientAddress);
+            sockaddr.sin6_addr.s6_addr[10] = sockaddr.sin6_addr.s6_addr[11] = UINT8_MAX;
+            memcpy(sockaddr.sin6_addr.s6_addr + 12, &clientAddressIPv4->sin_addr, 4);
+            sockaddr.sin6_port = clientAddressIPv4->sin_port;
             break;
         }
 
-        case AF_INET6: {
-            sockaddr_in6 clientAddressIPv6 = *reinterpret_cast<sockaddr_in6*>(&clientAddress);
-            inet_ntop(AF_INET6, &(clientAddressIPv6.sin6_addr), clientIp, sizeof(clientIp));
-            ret.port = ntohs(clientAddressIPv6.sin6_port);
-            ret.ip = std::string(clientIp);
-            ret.family = AF_INET6;
+        case AF_INET6:
+            sockaddr = *reinterpret_cast<const sockaddr_in6*>(&clientAddress);
             break;
-        }
 
         default:
-            ret.family = -1;
-            break;
+            return false;
     }
 
-    return ret;
+    addr = {};
+    addr.ip = sockaddr.sin6_addr;
+    addr.port = sockaddr.sin6_port;
+    addr.scopeId = sockaddr.sin6_scope_id;
+    return true;
 }
 
-// Kicks players that are idling for too long.
-void handleTimeouts(ServerNetworkData &socks, GameState &game) {
-    for (int i = 1; i <= MAX_PLAYERS; i++) {
-        if (socks.client[i].fd != -1 && (socks.client[i].revents & POLLIN)) {
-            for (auto &elt : socks.clientId) {
-                if (elt.second.timerId == i) {
-                    socks.usedNames.erase(elt.second.playerName);
-                    game.readyPlayers.erase(elt.second);
-                    if (!game.active) {
-                        game.playerPos.erase(elt.second);
-                    }
-
-                    socks.clientId.erase(elt.first);
-                    break;
-                }
-            }
+// Returns the hash of given address.
+uint64_t hashAddr(const ClientAddr &addr) {
+    uint64_t hi, lo;
+    memcpy(&hi, addr.ip.s6_addr, 8);
+    memcpy(&lo, addr.ip.s6_addr + 8, 8);
+    uint64_t h = (hi * 0x9E3779B97F4A7C15ULL) ^ lo ^ ((uint64_t)addr.port << 32 | addr.scopeId);
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 29);
+}
 
-            socks.freeTimerIds.insert(i);
-        }
-    }
+// Checks if two addresses are the same.
+bool sameAddr(const ClientAddr &a, const ClientAddr &b) {
+    return a.port == b.port && a.scopeId == b.scopeId && memcmp(&a.ip, &b.ip, sizeof(a.ip)) == 0;
 }
 
-// Prepares client timer and accepts a new player to join the game.
-void acceptPlayer(ServerNetworkData &socks, ClientAddr &addr, ClientInfo &msg) {
-    int timerId = *socks.freeTimerIds.begin();
-    socks.freeTimerIds.erase(timerId);
-    msg.timerId = timerId;
-    socks.clientId[addr] = msg;
+// Returns the slot where addr is stored or should be inserted.
+size_t findSlot(const ClientRegistry &reg, const ClientAddr &addr) {
+    size_t mask = reg.slots.size() - 1;
+    size_t i = hashAddr(addr) & mask;
+    while (reg.slots[i].state == SLOT_USED && !sameAddr(reg.slots[i].addr, addr)) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
 
-    if (msg.playerName != "") {
-        socks.usedNames.insert(msg.playerName);
+// Returns the client with given address or NULL if it isn't registered.
+ClientSlot *findClient(ClientRegistry &reg, const ClientAddr &addr) {
+    if (reg.slots.empty()) {
+        return NULL;
     }
 
-    itimerspec ts;
-    ts.it_interval.tv_sec = ts.it_interval.tv_nsec = ts.it_value.tv_nsec = 0;
-    ts.it_value.tv_sec = CLIENT_TIMEOUT;
+    ClientSlot &slot = reg.slots[findSlot(reg, addr)];
+    return slot.state == SLOT_USED ? &slot : NULL;
+}
 
-    if (timerfd_settime(socks.client[timerId].fd, 0, &ts, NULL) < 0) {
-        syserr("timerfd_settime()");
+// Registers a new client with given address, previously returned slots become invalid.
+ClientSlot *insertClient(ClientRegistry &reg, const ClientAddr &addr, const sockaddr_in6 &sockaddr) {
+    if (2 * (reg.size + 1) > reg.slots.size()) {
+        std::vector<ClientSlot> old = std::move(reg.slots);
+        reg.slots.assign(std::max((size_t)MIN_REGISTRY_CAPACITY, 2 * old.size()), ClientSlot{});
+        for (auto &slot : old) {
+            if (slot.state == SLOT_USED) {
+                reg.slots[findSlot(reg, slot.addr)] = std::move(slot);
+            }
+        }
     }
+
+    ClientSlot &slot = reg.slots[findSlot(reg, addr)];
+    assert(slot.state == SLOT_EMPTY);
+    slot.state = SLOT_USED;
+    slot.addr = addr;
+    slot.sockaddr = sockaddr;
+    reg.size++;
+    return &slot;
 }
 
-// Return the floor of given floating point value.
-int getFloor(double x) {
-    return static_cast<int>(std::floor(x));
+// Removes the client from the registry, shifting back the following slots of its
+// probe sequence so that no tombstones are needed.
+void eraseClient(ClientRegistry &reg, ClientSlot *client) {
+    size_t mask = reg.slots.size() - 1;
+    size_t hole = client - reg.slots.data();
+    size_t i = hole;
+    reg.slots[hole] = ClientSlot{};
+    reg.size--;
+    while (true) {
+        i = (i + 1) & mask;
+        if (reg.slots[i].state != SLOT_USED) {
+            return;
+        }
+
+        // Entry at i can fill the hole only if its home slot isn't in (hole, i].
+        size_t home = hashAddr(reg.slots[i].addr) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            reg.slots[hole] = std::move(reg.slots[i]);
+            reg.slots[i] = ClientSlot{};
+            hole = i;
+        }
+    }
 }
 
-// Prefixes the string with its big endian encoded length, and joins it with its crc32 checksum.
-std::string wrapEvent(std::string event) {
-    event = tonStr(event.size(), 4) + event;
-    event += tonStr(crc32(event.c_str(), event.size()), 4);
-    return event;
+// Puts client's timeout entry in the wheel slot of the tick its deadline falls on.
+void scheduleTimeout(TimerWheel &wheel, const ClientAddr &addr, ClientInfo &info) {
+    info.wheelTick = std::max(wheel.tick, (info.deadline + WHEEL_TICK - 1) / WHEEL_TICK);
+    wheel.slots[info.wheelTick % WHEEL_SLOTS].push_back(addr);
 }
 
-// Creates a new game event that can be read by clients.
-void createNewGameEvent(ServerParameters &params, GameState &game) {
-    std::string res;
-    uint32_t eventNo = game.events.size();
-    res += tonStr(eventNo, 4);
-    res += tonStr(NEW_GAME_EVENT, 1);
-    res += tonStr(params.width, 4);
-    res += tonStr(params.height, 4);
-    for (auto &i : game.readyPlayers) {
-        res += i.playerName;
-        res.append(1, '\0');
+// Kicks a client that was idling for too long.
+void kickClient(ServerNetworkData &socks, std::vector<Room> &rooms, ClientSlot *client) {
+    Room &room = rooms[client->info.room];
+    room.usedNames.erase(client->info.playerName);
+    room.game.readyPlayers.erase(client->info);
+    if (!room.game.active) {
+        room.game.playerPos.erase(client->info);
     }
 
-    game.events.push_back(wrapEvent(res));
+    room.sessions--;
+    eraseClient(socks.clientId, client);
+    setMetric(socks.metrics->sessions, socks.clientId.size);
 }
 
+// Advances the timer wheel up to the current time and kicks players that are idling for too long.
+void handleTimeouts(ServerNetworkData &socks, std::vector<Room> &rooms) {
+    TimerWheel &wheel = socks.wheel;
+    std::vector<ClientAddr> due;
+    for (; wheel.tick <= socks.now / WHEEL_TICK; wheel.tick++) {
+        due.clear();
+        std::swap(due, wheel.slots[wheel.tick % WHEEL_SLOTS]);
+        for (auto &addr : due) {
+            ClientSlot *client = findClient(socks.clientId, addr);
+            // Skip entries of clients that were kicked or already rescheduled.
+            if (!client || client->info.wheelTick != wheel.tick) {
+                continue;
+            }
 
-// Creates a game over event that can be read by clients.
-void createGameOverEvent(GameState &game) {
-    std::string res;
-    uint32_t eventNo = game.events.size();
-    res += tonStr(eventNo, 4);
-    res += tonStr(GAME_OVER_EVENT, 1);
-
-    game.events.push_back(wrapEvent(res));
+            if (client->info.deadline <= socks.now) {
+                kickClient(socks, rooms, client);
+            } else {
+                scheduleTimeout(wheel, addr, client->info);
+            }
+        }
+    }
 }
 
+// Returns poll timeout (in ms) that lets timeouts of connected clients be handled on time.
+int getPollTimeout(ServerNetworkData &socks) {
+    if (socks.clientId.size == 0) {
+        return -1;
+    }
 
-// Creates a player eliminated event that can be read by clients.
-void createPlayerEliminatedEvent(int order, GameState &game) {
-    std::string res;
-    uint32_t eventNo = game.events.size();
-    res += tonStr(eventNo, 4);
-    res += tonStr(PLAYER_ELIMINATED_EVENT, 1);
-    res += tonStr(order, 1);
-
-    game.events.push_back(wrapEvent(res));
+    uint64_t nextTick = socks.wheel.tick * WHEEL_TICK;
+    return nextTick > socks.now ? nextTick - socks.now : 0;
 }
 
+// Picks a room for a new client: a player joins the first room where he can play
+// the next game, a spectator the room with the most players (and then the fewest
+// sessions). Returns -1 if there's none.
+int chooseRoom(std::vector<Room> &rooms, const std::string &playerName) {
+    int best = -1;
+    for (size_t i = 0; i < rooms.size(); i++) {
+        Room &room = rooms[i];
+        if (playerName.empty()) {
+            if (best == -1 || room.usedNames.size() > rooms[best].usedNames.size()
+                || (room.usedNames.size() == rooms[best].usedNames.size() && room.sessions < rooms[best].sessions)) {
+                best = i;
+            }
 
-// Creates a new pixel event that can be read by clients.
-void createPixelEvent(int order, int x, int y, GameState &game) {
+            continue;
+        }
+
+        if (room.usedNames.count(playerName) || room.usedNames.size() >= MAX_PLAYERS) {
+            continue;
+        }
 
-    std::string res;
-    uint32_t eventNo = game.events.size();
-    res += tonStr(eventNo, 4);
-    res += tonStr(PIXEL_EVENT, 1);
-    res += tonStr(order, 1);
-    res += tonStr(x, 4);
-    res += tonStr(y, 4);
+        if (!room.game.active) {
+            return i;
+        }
 
+        if (best == -1) {
+            best = i;
+        }
+    }
 
-    game.events.push_back(wrapEvent(res));
+    return best;
 }
 
+// Sets client's deadline and accepts a new player to join the game in his room.
+ClientSlot *acceptPlayer(ServerNetworkData &socks, Room &room, const ClientAddr &addr,
+                         const sockaddr_in6 &sockaddr, ClientInfo &msg) {
+    ClientSlot *client = insertClient(socks.clientId, addr, sockaddr);
+    setMetric(socks.metrics->sessions, socks.clientId.size);
+    client->info = msg;
+    client->info.deadline = socks.now + CLIENT_TIMEOUT * 1000;
+    scheduleTimeout(socks.wheel, addr, client->info);
 
-// Renews players idle timer, so the server doesn't kick him for idling.
-void renewPlayer(ServerNetworkData &socks, ClientAddr &addr) {
-    int timerId = socks.clientId[addr].timerId;
+    room.sessions++;
+    if (msg.playerName != "") {
+        room.usedNames.insert(msg.playerName);
+    }
 
-    itimerspec ts{};
-    ts.it_interval.tv_sec = ts.it_interval.tv_nsec = ts.it_value.tv_nsec = 0;
-    ts.it_value.tv_sec = CLIENT_TIMEOUT;
+    return client;
+}
 
-    if (timerfd_settime(socks.client[timerId].fd, 0, &ts, NULL) < 0) {
-        syserr("timerfd_settime()");
+// Resizes the board to given dimensions and marks all of its fields as free.
+void resetBoard(OccupancyBoard &board, int64_t width, int64_t height) {
+    size_t words = (width * height + 63) / 64;
+    board.width = width;
+    board.height = height;
+    if (board.bits.size() != words) {
+        board.bits.assign(words, 0);
+    } else {
+        std::fill(board.bits.begin(), board.bits.end(), 0);
     }
+}
 
-    uint64_t res;
-    read(socks.client[timerId].fd, &res, sizeof(res));
+// Marks field (x, y) as eaten, returns whether it had already been eaten before.
+bool testAndSetField(OccupancyBoard &board, int x, int y) {
+    uint64_t idx = (uint64_t)y * board.width + x;
+    uint64_t mask = 1ULL << (idx & 63);
+    uint64_t &word = board.bits[idx >> 6];
+    bool eaten = word & mask;
+    word |= mask;
+    return eaten;
 }
 
-// Updates turn directions of players according to msg.
-void updatePlayerState(GameState &game, ClientMsg &msg, ClientInfo &info) {
-    if (msg.playerName.empty())
-        return;
+// Returns the number of bytes used by the board's bitmap.
+size_t boardMemoryUsage(const OccupancyBoard &board) {
+    return board.bits.capacity() * sizeof(uint64_t);
+}
+
+// Return the floor of given fixed-point value.
+int getFloor(int64_t x) {
+    return static_cast<int>(x >> FIXED_SHIFT);
+}
 
-    if (!game.active && msg.turnDirection) {
-        game.readyPlayers.insert(info);
+// Returns sin(x) for x in [-pi/4, pi/4] from its Taylor series, usable in constant expressions.
+constexpr double taylorSin(double x) {
+    double term = x, sum = x;
+    for (int i = 1; i <= 10; i++) {
+        term *= -x * x / ((2 * i) * (2 * i + 1));
+        sum += term;
     }
-    
-    game.playerPos[info].turnDirection = msg.turnDirection;
+    return sum;
 }
 
-// Sends events with ID's not less than @from to given client.
-void sendEvents(ServerNetworkData &socks, ClientAddr addr, GameState &game, uint32_t from) {
-    sockaddr_storage sAddr{};
-    if (addr.family == AF_INET) {
-        sockaddr_in sAddrIPv4 = *reinterpret_cast<sockaddr_in*>(&sAddr);
-        sAddrIPv4.sin_family = AF_INET;
-        inet_pton(AF_INET, addr.ip.c_str(), &sAddrIPv4.sin_addr);
-        sAddrIPv4.sin_port = htons(addr.port);
-        sAddr = *reinterpret_cast<sockaddr_storage*>(&sAddrIPv4);
-    } else {
-        assert(addr.family == AF_INET6);
-        sockaddr_in6 sAddrIPv6 = *reinterpret_cast<sockaddr_in6*>(&sAddr);
-        sAddrIPv6.sin6_family = AF_INET6;
-        inet_pton(AF_INET6, addr.ip.c_str(), &sAddrIPv6.sin6_addr);
-        sAddrIPv6.sin6_port = htons(addr.port);
-        sAddr = *reinterpret_cast<sockaddr_storage*>(&sAddrIPv6);
+// Returns cos(x) for x in [-pi/4, pi/4] from its Taylor series, usable in constant expressions.
+constexpr double taylorCos(double x) {
+    double term = 1, sum = 1;
+    for (int i = 1; i <= 10; i++) {
+        term *= -x * x / ((2 * i - 1) * (2 * i));
+        sum += term;
     }
+    return sum;
+}
 
-    std::string dgram = tonStr(game.gameId, 4);
-    for (; from < game.events.size(); ++from) {
-        dgram += game.events[from];
-        if (from + 1 == game.events.size() || dgram.size() + game.events[from].size() > 550) {
-            assert(dgram.size() <= 550);
+// Returns the sine of an angle in degrees, reduced to [-45, 45) around the nearest
+// multiple of 90 degrees, so that the series converges quickly and axes are exact.
+constexpr double degreeSin(int degrees) {
+    degrees = (degrees % 360 + 360) % 360;
+    int quadrant = (degrees + 45) / 90 % 4;
+    double angle = (degrees - quadrant * 90) * (M_PI / 180);
+    switch (quadrant) {
+        case 0:
+            return taylorSin(angle);
+        case 1:
+            return taylorCos(angle);
+        case 2:
+            return -taylorSin(angle);
+        default:
+            return -taylorCos(angle);
+    }
+}
 
-            if (sendto(socks.client[0].fd, dgram.c_str(), dgram.size(), 0, (sockaddr *) &sAddr, sizeof(sAddr)) == -1) {
-                return;
-            }
-            
-            dgram = tonStr(game.gameId, 4);
-        }
+// Returns value rounded to the nearest fixed-point number.
+constexpr int64_t toFixed(double value) {
+    return value >= 0 ? static_cast<int64_t>(value * FIXED_ONE + 0.5)
+                      : -static_cast<int64_t>(-value * FIXED_ONE + 0.5);
+}
+
+// Generates unit vectors of all directions at compile time.
+constexpr DirectionTable makeDirectionTable() {
+    DirectionTable table{};
+    for (int direction = 0; direction < 360; direction++) {
+        table.dx[direction] = toFixed(degreeSin(direction + 90));
+        table.dy[direction] = toFixed(degreeSin(direction));
     }
+    return table;
 }
 
-// Handles a single UDP packet received from some client.
-void handleConnection(ServerNetworkData &socks, GameState &game, GameState &oldGame) {
-    sockaddr_storage clientAddress{};
-    socklen_t rcvaLen = sizeof(clientAddress);
-    ssize_t len = recvfrom(socks.client[0].fd, socks.buf, MAX_EVENT_SIZE, 0, (sockaddr *)&clientAddress, &rcvaLen);
-    if (len > 0) {
-        ClientAddr addr = getClientAddr(clientAddress);
-        if (addr.family != AF_INET && addr.family != AF_INET6)
-            return;
+constexpr DirectionTable DIRECTIONS = makeDirectionTable();
 
-        ClientMsg msg{};
-        if (parseClientMsg(socks.buf, len, msg)) {
-            return;
-        }
+static_assert(DIRECTIONS.dx[0] == FIXED_ONE && DIRECTIONS.dy[90] == FIXED_ONE
+              && DIRECTIONS.dx[180] == -FIXED_ONE && DIRECTIONS.dy[270] == -FIXED_ONE,
+              "Direction table is inexact on axes");
 
-        ClientInfo info = {-1, msg.sessionId, msg.playerName};
-        if (!socks.clientId.count(addr) && socks.clientId.size() < MAX_PLAYERS) {
-            if (!msg.playerName.empty() && socks.usedNames.count(msg.playerName)) {
-                return;
-            }
+// Appends the sealed segment that is in memory to the end of the store's list.
+void linkSegment(SegmentStore &store, LogSegment &segment) {
+    segment.prev = store.tail;
+    segment.next = NULL;
+    (store.tail ? store.tail->next : store.head) = &segment;
+    store.tail = &segment;
+    segment.linked = true;
+}
 
-            acceptPlayer(socks, addr, info);
-        } else if (socks.clientId.count(addr)) {
-            if (msg.sessionId < socks.clientId[addr].sessionId) {
-                return;
-            }
+// Removes the segment from the store's list.
+void unlinkSegment(SegmentStore &store, LogSegment &segment) {
+    (segment.prev ? segment.prev->next : store.head) = segment.next;
+    (segment.next ? segment.next->prev : store.tail) = segment.prev;
+    segment.prev = segment.next = NULL;
+    segment.linked = false;
+}
 
-            if (msg.sessionId > socks.clientId[addr].sessionId) {
-                info.timerId = socks.clientId[addr].timerId;
-                socks.clientId[addr] = info;
-            }
+// Returns the number of bytes the sealed segment takes in memory and in the spill file.
+uint64_t segmentBytes(const LogSegment &segment) {
+    return segment.size + segment.events * sizeof(uint32_t);
+}
 
-            renewPlayer(socks, addr);
-        } else {  
-            return;
+// Reads or writes the sealed segment's data and offsets at its offset of the spill file.
+void transferSegment(int fd, LogSegment &segment, bool write) {
+    iovec iov[2] = {{segment.data.data(), segment.size}, {segment.offsets.data(), segment.events * sizeof(uint32_t)}};
+    uint64_t done = 0, total = segmentBytes(segment);
+    while (done < total) {
+        uint64_t offset = segment.spillOffset + done;
+        ssize_t len = write ? pwritev(fd, iov, 2, offset) : preadv(fd, iov, 2, offset);
+        if (len <= 0) {
+            syserr(write ? "pwritev()" : "preadv()");
         }
 
-        info = socks.clientId[addr];
-        updatePlayerState(game, msg, info);
-        if (game.active) {
-            sendEvents(socks, addr, game, msg.nextExpectedEventNo);
-        } else {
-            sendEvents(socks, addr, oldGame, msg.nextExpectedEventNo);
+        done += len;
+        for (iovec &part : iov) {
+            size_t skipped = std::min<size_t>(len, part.iov_len);
+            part.iov_base = (char *)part.iov_base + skipped;
+            part.iov_len -= skipped;
+            len -= skipped;
         }
     }
 }
 
-// Simulates a single frame of the game's logic.
-void updateGame(ServerParameters &params, GameState &game) {
-    std::vector<ClientInfo> toErase;
-    for (auto &i: game.playerPos) {
-        if (i.second.turnDirection == 1) {
-            i.second.direction += params.turningSpeed;
-            i.second.direction %= 360;
-        } 
+// Creates the spill file, it's unlinked right away so it disappears with the server.
+int openSpillFile() {
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir && dir[0] ? dir : "/tmp") + "/screen-worms-spill-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        syserr("mkstemp(%s)", path.c_str());
+    }
+    unlink(path.c_str());
+    return fd;
+}
 
-        if (i.second.turnDirection == 2) {
-            i.second.direction -= params.turningSpeed;
-            i.second.direction %= 360;
-            if (i.second.direction < 360) i.second.direction += 360;
+// Writes the sealed segment to the spill file unless it's already there and frees its memory.
+void spillSegment(SegmentStore &store, LogSegment &segment) {
+    if (!segment.spilled) {
+        if (store.spillFd == -1) {
+            store.spillFd = openSpillFile();
         }
 
-        int oldX = getFloor(i.second.x), oldY = getFloor(i.second.y);    
-        i.second.x += cos(i.second.direction / 180.0 * M_PI);
-        i.second.y += sin(i.second.direction / 180.0 * M_PI);
+        segment.spillOffset = store.spillEnd;
+        transferSegment(store.spillFd, segment, true);
+        segment.spilled = true;
+        store.spillEnd += segmentBytes(segment);
+        store.spills++;
+    }
 
-        int x = getFloor(i.second.x), y = getFloor(i.second.y);
-        if (oldX == x && oldY == y) {
-            continue;
-        } else if (game.eatenFields.count({x, y}) || x < 0 || x >= params.width || y < 0 || y >= params.height) {
-            createPlayerEliminatedEvent(i.second.order, game);
-            toErase.push_back(i.first);
-            if (game.playerPos.size() - toErase.size() == 1) {
-                createGameOverEvent(game);
-                break;
-            }
+    store.resident -= segment.accounted;
+    segment.accounted = 0;
+    unlinkSegment(store, segment);
+    std::vector<char>().swap(segment.data);
+    std::vector<uint32_t>().swap(segment.offsets);
+    segment.resident = false;
+}
+
+// Reads the spilled segment back from the spill file.
+void loadSegment(LogSegment &segment) {
+    SegmentStore &store = *segment.store;
+    segment.data.resize(segment.size);
+    segment.offsets.resize(segment.events);
+    transferSegment(store.spillFd, segment, false);
+    segment.resident = true;
+    segment.accounted = segmentBytes(segment);
+    store.resident += segment.accounted;
+    store.pageIns++;
+    linkSegment(store, segment);
+}
+
+// Spills sealed segments until the ones in memory fit in the budget. It must be called only
+// when no datagram queued for sending points into the logs, as it frees the spilled events.
+void trimSegments(SegmentStore &store) {
+    while (store.resident + store.pageBytes > store.budget && store.head) {
+        LogSegment &segment = *store.head;
+        if (segment.referenced) {
+            segment.referenced = false;
+            unlinkSegment(store, segment);
+            linkSegment(store, segment);
         } else {
-            createPixelEvent(i.second.order, x, y, game);
-            game.eatenFields.insert({x, y});
+            spillSegment(store, segment);
         }
     }
+}
 
-    for (auto i : toErase) {
-        game.playerPos.erase(i);
+// Returns the segment's memory to the store and punches its events out of the spill file.
+LogSegment::~LogSegment() {
+    if (!store) {
+        return;
     }
-}
 
-// Sends new events to all players.
-void broadcastEvents(ServerNetworkData &socks, GameState &game, uint32_t from) {
-    for (auto &i : socks.clientId) {
-        sendEvents(socks, i.first, game, from);
+    store->resident -= accounted;
+    if (linked) {
+        unlinkSegment(*store, *this);
+    }
+    if (spilled) {
+        fallocate(store->spillFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, spillOffset, segmentBytes(*this));
     }
 }
 
-// Generates a single game frame and broadcasts it to all connected clients.
-void handleGameFrame(ServerParameters &params, ServerNetworkData &socks, GameState &game) {
-    uint64_t ret;
-    size_t lastEventNo = game.events.size();
+// Seals the last segment of the log, a sealed segment can be spilled once it's settled.
+void sealLastSegment(EventLog &log) {
+    if (log.segments.empty() || log.segments.back()->sealed) {
+        return;
+    }
 
-    int rbytes = read(socks.client[GAME_TIMER_ID].fd, &ret, sizeof(ret));
-    if (rbytes > 0) {
-        if (!game.active) {
-            return;
-        }
+    LogSegment &segment = *log.segments.back();
+    segment.sealed = true;
+    segment.events = segment.offsets.size();
+}
+
+// Accounts for bytes appended to the log since it was last settled and puts its new sealed
+// segments on the store's list. Appending doesn't touch the store, so that workers can
+// simulate games of all rooms at once, the main thread settles their logs afterwards.
+void settleEventLog(EventLog &log) {
+    if (!log.store) {
+        return;
+    }
 
-        for (uint64_t rep = 0; rep < ret; rep++) {
-            updateGame(params, game);
-            broadcastEvents(socks, game, lastEventNo);
-            lastEventNo = game.events.size();
+    for (; log.settled < log.segments.size(); log.settled++) {
+        LogSegment &segment = *log.segments[log.settled];
+        uint64_t bytes = segment.size + segment.offsets.size() * sizeof(uint32_t);
+        log.store->resident += bytes - segment.accounted;
+        segment.accounted = bytes;
+        if (!segment.sealed) {
+            break;
         }
+        linkSegment(*log.store, segment);
     }
 }
 
-// Dispatches server operations according to active timers.
-void handlePollEvent(ServerParameters &params, ServerNetworkData &socks,
-                     GameState &game, int timeout, GameState &oldGame) {
-    int ret = poll(socks.client, MAX_PLAYERS + 2, timeout);
-    if (ret == -1) {
-        if (errno == EINTR) {
-            fprintf(stderr, "Interrupted syscall\n");
-        } else {
-            syserr("poll");
-        }
-    } else if (ret > 0) {
-        handleTimeouts(socks, game);
-        if (socks.client[0].revents & POLLIN) {
-            handleConnection(socks, game, oldGame);
-            socks.client[0].revents = 0;
-        }
+// Returns the number of events stored in the log.
+uint32_t eventCount(const EventLog &log) {
+    return log.events;
+}
 
-        handleGameFrame(params, socks, game);
-        if (game.playerPos.size() < 2) {
-            game.active = false;
-        }
+// Returns the index of the segment holding event eventNo, usually the last one.
+size_t findSegment(const EventLog &log, uint32_t eventNo) {
+    if (eventNo >= log.firstEvents.back()) {
+        return log.firstEvents.size() - 1;
+    }
+    return std::upper_bound(log.firstEvents.begin(), log.firstEvents.end(), eventNo) - log.firstEvents.begin() - 1;
+}
 
-        for (int i = 0; i <= MAX_PLAYERS + 1; i++) {
-            socks.client[i].revents = 0;
-        }
+// Returns the segment with given index, reading it back from the spill file if it isn't in memory.
+LogSegment &getSegment(const EventLog &log, size_t index) {
+    LogSegment &segment = *log.segments[index];
+    segment.referenced = true;
+    if (!segment.resident) {
+        assert(segment.spilled);
+        loadSegment(segment);
     }
+    return segment;
 }
 
-// Generates the first frame of a new game.
-void startGame(ServerParameters &params, GameState &game) {
-    game.gameId = getNextRand(params.rng);
-    game.active = true;
-    createNewGameEvent(params, game);
+// Returns the wrapped event eventNo, its bytes stay valid until the segments are trimmed.
+const char *eventData(const EventLog &log, uint32_t eventNo) {
+    size_t index = findSegment(log, eventNo);
+    LogSegment &segment = getSegment(log, index);
+    return segment.data.data() + segment.offsets[eventNo - log.firstEvents[index]];
+}
 
-    std::vector<ClientInfo> toErase;
-    int order = 0;
-    for (auto &i : game.playerPos) {
-        i.second.order = order++;
-        i.second.x = getNextRand(params.rng) % params.width + 0.5;
-        i.second.y = getNextRand(params.rng) % params.height + 0.5;
-        i.second.direction = getNextRand(params.rng) % 360;
+// Returns the size of the wrapped event eventNo.
+size_t eventSize(const EventLog &log, uint32_t eventNo) {
+    return getBigEndian(eventData(log, eventNo), 4) + 8;
+}
 
-        int x = getFloor(i.second.x);
-        int y = getFloor(i.second.y);
-        if (game.eatenFields.count({x, y})) {
-            createPlayerEliminatedEvent(i.second.order, game);
-            if (game.playerPos.size() - toErase.size() == 1) {
-                createGameOverEvent(game);
-                toErase.push_back(i.first);
-                break;
-            }
-        } else {
-            createPixelEvent(i.second.order, x, y, game);
-            game.eatenFields.insert({x, y});
+// Returns the number of the first event after the segment holding event eventNo, or the number of
+// events when it's in the last one. Events [eventNo, segmentEnd) are contiguous in memory.
+uint32_t segmentEnd(const EventLog &log, uint32_t eventNo) {
+    size_t index = findSegment(log, eventNo);
+    return index + 1 < log.firstEvents.size() ? log.firstEvents[index + 1] : log.events;
+}
+
+// Appends wrapped events [from, count) of the log to out.
+void copyEvents(const EventLog &log, uint32_t from, std::vector<char> &out) {
+    for (size_t index = findSegment(log, from); from < log.events; index++) {
+        LogSegment &segment = getSegment(log, index);
+        out.insert(out.end(), segment.data.begin() + segment.offsets[from - log.firstEvents[index]],
+                   segment.data.begin() + segment.size);
+        from = index + 1 < log.firstEvents.size() ? log.firstEvents[index + 1] : log.events;
+    }
+}
+
+// Frees sealed segments holding only events before given one, which are never read again.
+// Used for logs that are never spilled.
+void dropEvents(EventLog &log, uint32_t before) {
+    for (size_t index = 0; index + 1 < log.segments.size() && log.firstEvents[index + 1] <= before; index++) {
+        LogSegment &segment = *log.segments[index];
+        if (segment.resident && segment.sealed) {
+            std::vector<char>().swap(segment.data);
+            std::vector<uint32_t>().swap(segment.offsets);
+            segment.resident = false;
         }
     }
+}
 
-    for (auto i : toErase) {
-        game.playerPos.erase(i);
+// Makes room for a wrapped event of given size at the end of the log, in a new segment
+// if it doesn't fit in the last one, and returns the position where it is to be written.
+char *reserveEvent(EventLog &log, uint32_t size) {
+    if (log.segments.empty() || log.segments.back()->size + size > LOG_SEGMENT_SIZE) {
+        sealLastSegment(log);
+        auto segment = std::make_unique<LogSegment>();
+        segment->resident = true;
+        segment->store = log.store;
+        log.segments.push_back(std::move(segment));
+        log.firstEvents.push_back(log.events);
     }
+
+    LogSegment &segment = *log.segments.back();
+    segment.offsets.push_back(segment.size);
+    segment.data.resize(segment.size + size);
+    log.cursor = segment.size;
+    segment.size += size;
+    log.events++;
+    log.bytes += size;
+    return segment.data.data() + log.cursor;
 }
 
-int main(int argc, char **argv) {
-    // Set server params to default values.
-    ServerParameters params = {(uint64_t)time(NULL) & UINT32_MAX, DEFAULT_TURNING_SPEED,
-                               DEFAULT_RPS, DEFAULT_SERVER_PORT, DEFAULT_WIDTH, DEFAULT_HEIGHT};
+// Appends a whole wrapped event to the log.
+void appendEvent(EventLog &log, const char *event, uint32_t size) {
+    memcpy(reserveEvent(log, size), event, size);
+    log.cursor += size;
+}
 
-    // Update params with shell options that user has provided.
-    getOptions(argc, argv, params);
+// Appends field encoded on nbytes big endian bytes to the event being written.
+void putEventField(EventLog &log, uint64_t x, uint32_t nbytes) {
+    char *dst = log.segments.back()->data.data() + log.cursor;
+    putBigEndian(dst, x, nbytes);
+    log.crc = crc32Update(log.crc, dst, nbytes);
+    log.cursor += nbytes;
+}
 
-    // Prepare sockets for UDP communication.
-    ServerNetworkData socks{};
-    socks = setupSockets(params);
+// Appends raw bytes to the event being written.
+void putEventBytes(EventLog &log, const char *src, size_t size) {
+    char *dst = log.segments.back()->data.data() + log.cursor;
+    memcpy(dst, src, size);
+    log.crc = crc32Update(log.crc, dst, size);
+    log.cursor += size;
+}
 
-    GameState oldGame{};
+// Starts a new event of given type with len bytes of event_no, event_type
+// and event_data, its length prefix, number and type are written in place.
+void beginEvent(EventLog &log, uint32_t len, uint8_t type) {
+    uint32_t eventNo = eventCount(log);
+    reserveEvent(log, 4 + len + 4);
+    log.crc = ~0U;
 
-    // Server is meant to run indefinitely, thus we start new games in an endless loop.
-    while (true) {
-        GameState game{};
-        game.active = false;
-        while (socks.usedNames.size() < 2 || game.readyPlayers.size() < socks.usedNames.size()) {
-            handlePollEvent(params, socks, game, -1, oldGame);
-        }
+    putEventField(log, len, 4);
+    putEventField(log, eventNo, 4);
+    putEventField(log, type, 1);
+}
 
-        startGame(params, game);
-        resetGameTimer(params, socks);
-        broadcastEvents(socks, game, 0);
-        if (game.playerPos.size() < 2) {
-            game.active = false;
-        }
+// Finishes the event being written by appending its crc32 checksum.
+void endEvent(EventLog &log) {
+    putBigEndian(log.segments.back()->data.data() + log.cursor, log.crc ^ ~0U, 4);
+    log.cursor += 4;
+    assert(log.cursor == log.segments.back()->size);
+}
 
-        oldGame.events = {};
-        while (game.active) {
-            handlePollEvent(params, socks, game, -1, oldGame);
-        }
+// Sets the id of the game and the datagram prefix encoding it.
+void setGameId(GameState &game, uint32_t gameId) {
+    game.gameId = gameId;
+    putBigEndian(game.gameIdPrefix, gameId, 4);
+}
 
-        oldGame.gameId = game.gameId;
-        oldGame.events = game.events;
+// Creates a new game event that can be read by clients.
+void createNewGameEvent(ServerParameters &params, GameState &game) {
+    uint32_t len = 4 + 1 + 4 + 4;
+    for (auto &i : game.readyPlayers) {
+        len += i.playerName.size() + 1;
     }
-}
\ No newline at end of file
+
+    beginEvent(game.events, len, NEW_GAME_EVENT);
+    putEventField(game.events, params.width, 4);
+    putEventField(game.events, params.height, 4);
+    for (auto &i : game.readyPlayers) {
+        putEventBytes(game.events, i.playerName.c_str(), i.playerName.size() + 1);
+    }
+
+    endEvent(game.events);
+}
+
+
+// Creates a game over event that can be read by clients.
+void createGameOverEvent(GameState &game) {
+    beginEvent(game.events, 4 + 1, GAME_OVER_EVENT);
+    endEvent(game.events);
+}
+
+
+// Creates a player eliminated event that can be read by clients.
+void createPlayerEliminatedEvent(int order, GameState &game) {
+    beginEvent(game.events, 4 + 1 + 1, PLAYER_ELIMINATED_EVENT);
+    putEventField(game.events, order, 1);
+    endEvent(game.events);
+}
+
+
+// Creates a new pixel event that can be read by clients.
+void createPixelEvent(int order, int x, int y, GameState &game) {
+    beginEvent(game.events, 4 + 1 + 1 + 4 + 4, PIXEL_EVENT);
+    putEventField(game.events, order, 1);
+    putEventField(game.events, x, 4);
+    putEventField(game.events, y, 4);
+    endEvent(game.events);
+}
+
+
+// Renews players idle timer, so the server doesn't kick him for idling.
+void renewPlayer(ServerNetworkData &socks, ClientInfo &info) {
+    info.deadline = socks.now + CLIENT_TIMEOUT * 1000;
+}
+
+// Updates turn directions of players according to msg, players join a game only before it starts.
+void updatePlayerState(GameState &game, ClientMsg &msg, ClientInfo &info) {
+    if (msg.playerName.empty())
+        return;
+
+    if (!game.active) {
+        if (msg.turnDirection) {
+            game.readyPlayers.insert(info);
+        }
+        game.playerPos[info].turnDirection = msg.turnDirection;
+        return;
+    }
+
+    auto it = game.playerPos.find(info);
+    if (it != game.playerPos.end()) {
+        it->second.turnDirection = msg.turnDirection;
+    }
+}
+
+// Returns the datagram page starting with event from, packs it only when
+// it isn't cached yet or the log has grown since it was packed. Events of a page
+// are sent straight from the log, so it ends with the segment of its first event.
+DatagramPage &getPage(ServerNetworkData &socks, GameState &game, uint32_t from) {
+    uint32_t count = eventCount(game.events);
+    auto it = game.pages.find(from);
+    if (it != game.pages.end() && (it->second.full || it->second.to == count)) {
+        socks.stats.pageHits++;
+        socks.stats.pageBytesSaved += it->second.size;
+        return it->second;
+    }
+
+    socks.stats.pageMisses++;
+    DatagramPage page = {from, 4, false};
+    uint32_t end = segmentEnd(game.events, from);
+    while (page.to < count) {
+        // A single event always fits in a datagram, so the page is never empty.
+        if (page.to == end || page.size + eventSize(game.events, page.to) > MAX_EVENT_SIZE) {
+            page.full = true;
+            break;
+        }
+
+        page.size += eventSize(game.events, page.to++);
+    }
+
+    return game.pages[from] = page;
+}
+
+// Writes event eventNo of the log to dst in the compact format of protocol v2, returns its size.
+// Pixels are coded relative to the last pixels in the datagram, which are updated.
+size_t encodeCompactEvent(const EventLog &log, uint32_t eventNo, CompactPixels &last, char *dst) {
+    const char *event = eventData(log, eventNo);
+    uint32_t payloadLen = getBigEndian(event, 4) - 5;
+    uint8_t type = event[8];
+    const char *payload = event + 9;
+    size_t size = 1;
+    switch (type) {
+        case NEW_GAME_EVENT:
+            dst[0] = (char)(type << COMPACT_TYPE_SHIFT);
+            size += putVarint(dst + size, getBigEndian(payload, 4));
+            size += putVarint(dst + size, getBigEndian(payload + 4, 4));
+            size += putVarint(dst + size, payloadLen - 8);
+            memcpy(dst + size, payload + 8, payloadLen - 8);
+            size += payloadLen - 8;
+            break;
+
+        case PIXEL_EVENT: {
+            uint8_t player = payload[0];
+            int64_t x = getBigEndian(payload + 1, 4), y = getBigEndian(payload + 5, 4);
+            dst[0] = (char)(type << COMPACT_TYPE_SHIFT | player);
+            if (last.seen[player]) {
+                size += putVarint(dst + size, zigzag(x - last.x[player]));
+                size += putVarint(dst + size, zigzag(y - last.y[player]));
+            } else {
+                size += putVarint(dst + size, x);
+                size += putVarint(dst + size, y);
+            }
+
+            last.seen[player] = true;
+            last.x[player] = x;
+            last.y[player] = y;
+            break;
+        }
+
+        case PLAYER_ELIMINATED_EVENT:
+            dst[0] = (char)(type << COMPACT_TYPE_SHIFT | (uint8_t)payload[0]);
+            break;
+
+        default:
+            dst[0] = (char)(type << COMPACT_TYPE_SHIFT);
+            break;
+    }
+
+    return size;
+}
+
+// Returns the protocol v2 page starting with event from, packs it only when
+// it isn't cached yet or the log has grown since it was packed.
+CompactPage &getCompactPage(ServerNetworkData &socks, GameState &game, uint32_t from) {
+    uint32_t count = eventCount(game.events);
+    auto it = game.compactPages.find(from);
+    if (it != game.compactPages.end() && (it->second.full || it->second.to == count)) {
+        socks.stats.pageHits++;
+        socks.stats.pageBytesSaved += it->second.bytes.size();
+        return it->second;
+    }
+
+    socks.stats.pageMisses++;
+    CompactPage &page = game.compactPages[from];
+    game.compactBytes -= page.bytes.capacity();
+    page.to = from;
+    page.full = false;
+    page.bytes.resize(MAX_EVENT_SIZE - sizeof(game.gameIdPrefix));
+
+    // Room for the CRC is left at the end.
+    size_t limit = page.bytes.size() - 4;
+    size_t size = 0;
+    page.bytes[size++] = (char)COMPACT_MARKER;
+    size += putVarint(page.bytes.data() + size, from);
+
+    CompactPixels last{};
+    char event[MAX_EVENT_SIZE];
+    while (page.to < count) {
+        // A single event always fits in a datagram, so the page is never empty.
+        size_t eventSize = encodeCompactEvent(game.events, page.to, last, event);
+        if (size + eventSize > limit) {
+            page.full = true;
+            break;
+        }
+
+        memcpy(page.bytes.data() + size, event, eventSize);
+        size += eventSize;
+        page.to++;
+    }
+
+    uint32_t crc = crc32Update(~0U, game.gameIdPrefix, sizeof(game.gameIdPrefix));
+    putBigEndian(page.bytes.data() + size, crc32Update(crc, page.bytes.data(), size) ^ ~0U, 4);
+    page.bytes.resize(size + 4);
+    game.compactBytes += page.bytes.capacity();
+    return page;
+}
+
+// Appends pixel (x, y) to the player's trail, extending its last run when the pixel neighbours its end.
+void appendTrailPixel(std::vector<TrailRun> &trail, uint32_t x, uint32_t y) {
+    if (!trail.empty()) {
+        TrailRun &run = trail.back();
+        for (uint8_t code = 0; code < 8; code++) {
+            if ((int64_t)run.endX + CHAIN_DX[code] == x && (int64_t)run.endY + CHAIN_DY[code] == y) {
+                run.codes.push_back(code);
+                run.endX = x;
+                run.endY = y;
+                return;
+            }
+        }
+    }
+
+    trail.push_back({x, y, x, y, {}});
+}
+
+// Folds events [kf.folded, to) of the log into the board state of keyframes.
+void foldKeyframeEvents(KeyframeState &kf, const EventLog &log, uint32_t to) {
+    for (; kf.folded < to; kf.folded++) {
+        const char *event = eventData(log, kf.folded);
+        uint32_t payloadLen = getBigEndian(event, 4) - 5;
+        const char *payload = event + 9;
+        switch (event[8]) {
+            case NEW_GAME_EVENT:
+                kf.width = getBigEndian(payload, 4);
+                kf.height = getBigEndian(payload + 4, 4);
+                kf.names.assign(payload + 8, payloadLen - 8);
+                kf.trails.resize(std::count(kf.names.begin(), kf.names.end(), '\0'));
+                break;
+
+            case PIXEL_EVENT:
+                appendTrailPixel(kf.trails[(uint8_t)payload[0]], getBigEndian(payload + 1, 4), getBigEndian(payload + 5, 4));
+                break;
+
+            case PLAYER_ELIMINATED_EVENT:
+                kf.eliminated |= 1U << (uint8_t)payload[0];
+                break;
+        }
+    }
+}
+
+// Returns the keyframe of the folded board state: varint dimensions, varint length of player
+// names and the names as in NEW_GAME, varint bitmask of eliminated players and trails of all
+// players. A trail is a varint number of runs, a run is its varint first pixel, varint number
+// of chain codes and the codes packed into bytes starting from their lowest bits.
+std::vector<char> encodeKeyframe(const KeyframeState &kf) {
+    std::vector<char> out(4 * MAX_VARINT_SIZE + kf.names.size());
+    size_t size = 0;
+    size += putVarint(out.data() + size, kf.width);
+    size += putVarint(out.data() + size, kf.height);
+    size += putVarint(out.data() + size, kf.names.size());
+    memcpy(out.data() + size, kf.names.data(), kf.names.size());
+    size += kf.names.size();
+    size += putVarint(out.data() + size, kf.eliminated);
+
+    for (auto &trail : kf.trails) {
+        out.resize(size + MAX_VARINT_SIZE);
+        size += putVarint(out.data() + size, trail.size());
+        for (auto &run : trail) {
+            size_t codeBytes = (run.codes.size() * CHAIN_CODE_BITS + 7) / 8;
+            out.resize(size + 3 * MAX_VARINT_SIZE + codeBytes);
+            size += putVarint(out.data() + size, run.x);
+            size += putVarint(out.data() + size, run.y);
+            size += putVarint(out.data() + size, run.codes.size());
+            std::fill(out.begin() + size, out.begin() + size + codeBytes, 0);
+            for (size_t i = 0; i < run.codes.size(); i++) {
+                size_t bit = i * CHAIN_CODE_BITS;
+                uint32_t code = run.codes[i] << (bit % 8);
+                out[size + bit / 8] |= code & 0xFF;
+                if (bit % 8 + CHAIN_CODE_BITS > 8) {
+                    out[size + bit / 8 + 1] |= code >> 8;
+                }
+            }
+            size += codeBytes;
+        }
+    }
+
+    out.resize(size);
+    return out;
+}
+
+// Returns the latest keyframe of the game, a new one is built when the log has grown
+// by KEYFRAME_INTERVAL events. A final GAME_OVER event is always left for the tail.
+// The keyframe has no parts when it is too small to be worth it or too big to be sent.
+KeyframeState &getKeyframe(GameState &game) {
+    KeyframeState &kf = game.keyframes;
+    uint32_t count = eventCount(game.events);
+    if (count > 0 && eventData(game.events, count - 1)[8] == GAME_OVER_EVENT) {
+        count--;
+    }
+    if (count < KEYFRAME_MIN_EVENTS || (kf.events != 0 && count < kf.events + KEYFRAME_INTERVAL)) {
+        return kf;
+    }
+
+    foldKeyframeEvents(kf, game.events, count);
+    std::vector<char> payload = encodeKeyframe(kf);
+    size_t parts = (payload.size() + KEYFRAME_PART_SIZE - 1) / KEYFRAME_PART_SIZE;
+    kf.events = count;
+    kf.parts.clear();
+    if (parts > MAX_KEYFRAME_PARTS) {
+        return kf;
+    }
+
+    // Every part is marked with the number of events the keyframe covers, its number and
+    // the number of parts, it ends with the CRC of the whole datagram.
+    for (size_t i = 0; i < parts; i++) {
+        size_t sliceSize = std::min(payload.size() - i * KEYFRAME_PART_SIZE, (size_t)KEYFRAME_PART_SIZE);
+        std::vector<char> &part = kf.parts.emplace_back(1 + 3 * MAX_VARINT_SIZE + sliceSize + 4);
+        size_t size = 0;
+        part[size++] = (char)KEYFRAME_MARKER;
+        size += putVarint(part.data() + size, count);
+        size += putVarint(part.data() + size, i);
+        size += putVarint(part.data() + size, parts);
+        memcpy(part.data() + size, payload.data() + i * KEYFRAME_PART_SIZE, sliceSize);
+        size += sliceSize;
+
+        uint32_t crc = crc32Update(~0U, game.gameIdPrefix, sizeof(game.gameIdPrefix));
+        putBigEndian(part.data() + size, crc32Update(crc, part.data(), size) ^ ~0U, 4);
+        part.resize(size + 4);
+    }
+
+    return kf;
+}
+
+// Queues all datagrams of the keyframe for given client.
+void queueKeyframe(ServerNetworkData &socks, const sockaddr_in6 &addr, GameState &game, KeyframeState &kf) {
+    SendBatch &batch = socks.batch;
+    batch.addrs.push_back(addr);
+    for (auto &part : kf.parts) {
+        batch.iovs.push_back({game.gameIdPrefix, sizeof(game.gameIdPrefix)});
+        batch.iovs.push_back({part.data(), part.size()});
+        batch.recipients.push_back(batch.addrs.size() - 1);
+    }
+
+    socks.stats.keyframesSent++;
+}
+
+// Queues datagrams with events with ID's not less than @from for given client,
+// in protocol v1 they are sent straight out of the event log, prefixed by the game id.
+void queueEvents(ServerNetworkData &socks, const sockaddr_in6 &addr, GameState &game, uint32_t from, uint8_t protocol) {
+    SendBatch &batch = socks.batch;
+    if (from >= eventCount(game.events)) {
+        return;
+    }
+
+    batch.addrs.push_back(addr);
+    while (from < eventCount(game.events)) {
+        batch.iovs.push_back({game.gameIdPrefix, sizeof(game.gameIdPrefix)});
+        if (protocol == PROTOCOL_V2) {
+            CompactPage &page = getCompactPage(socks, game, from);
+            batch.iovs.push_back({page.bytes.data(), page.bytes.size()});
+            from = page.to;
+        } else {
+            DatagramPage &page = getPage(socks, game, from);
+            batch.iovs.push_back({(void *)eventData(game.events, from), page.size - sizeof(game.gameIdPrefix)});
+            from = page.to;
+        }
+        batch.recipients.push_back(batch.addrs.size() - 1);
+    }
+}
+
+// Submits all queued datagrams with as few sendmmsg calls as possible. Sends don't block,
+// when the socket buffer stays full datagrams that can't be sent are dropped as clients
+// will ask for them again.
+void flushEvents(ServerNetworkData &socks) {
+    SendBatch &batch = socks.batch;
+    size_t count = batch.recipients.size();
+    batch.msgs.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        msghdr &hdr = batch.msgs[i].msg_hdr;
+        hdr = {};
+        hdr.msg_name = &batch.addrs[batch.recipients[i]];
+        hdr.msg_namelen = sizeof(sockaddr_in6);
+        hdr.msg_iov = &batch.iovs[2 * i];
+        hdr.msg_iovlen = 2;
+    }
+
+    size_t sent = 0;
+    int retries = 0;
+    while (sent < count) {
+        int ret = sendmmsg(socks.sock, &batch.msgs[sent], count - sent, MSG_DONTWAIT);
+        socks.stats.sendSyscalls++;
+        if (ret > 0) {
+            addMetric(socks.metrics->packetsOut, ret);
+            addMetric(socks.metrics->bytesOut, batchBytes(&batch.msgs[sent], ret));
+            sent += ret;
+            socks.stats.datagramsSent += ret;
+        } else if (errno == EINTR) {
+            continue;
+        } else if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) && retries < SEND_RETRIES) {
+            // Socket buffer is full, give the kernel a moment to drain it.
+            pollfd pfd = {socks.sock, POLLOUT, 0};
+            poll(&pfd, 1, SEND_RETRY_TIMEOUT);
+            retries++;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            socks.stats.datagramsDropped += count - sent;
+            break;
+        } else {
+            // The first datagram failed on its own (e.g. unreachable client), skip it.
+            socks.stats.datagramsDropped++;
+            sent++;
+        }
+    }
+
+    batch.addrs.clear();
+    batch.iovs.clear();
+    batch.recipients.clear();
+}
+
+// Sends events with ID's not less than @from to given client.
+void sendEvents(ServerNetworkData &socks, const sockaddr_in6 &addr, GameState &game, uint32_t from) {
+    queueEvents(socks, addr, game, from, PROTOCOL_V1);
+    flushEvents(socks);
+}
+
+// Points the client's cursor at given game, nothing of it was sent to the client yet.
+void syncCursor(ClientSlot &client, GameState &game) {
+    if (client.cursor.gameId != game.gameId) {
+        client.cursor = {game.gameId, 0, 0, 0};
+    }
+}
+
+// Queues events of the game that weren't sent to the client yet and starts
+// the retransmission timer if they are the only unacknowledged ones.
+bool queueNewEvents(ServerNetworkData &socks, ClientSlot &client, GameState &game) {
+    DeliveryCursor &cursor = client.cursor;
+    uint32_t count = eventCount(game.events);
+    if (cursor.sent >= count) {
+        return false;
+    }
+
+    if (cursor.acked >= cursor.sent) {
+        cursor.rtoStart = socks.now;
+    }
+
+    queueEvents(socks, client.sockaddr, game, cursor.sent, client.protocol);
+    cursor.sent = count;
+    return true;
+}
+
+// Updates the client's cursor with the number of the next event it expects,
+// numbers beyond the end of the log come from its previous game and are ignored.
+void ackEvents(ServerNetworkData &socks, ClientSlot &client, GameState &game, uint32_t nextExpectedEventNo) {
+    DeliveryCursor &cursor = client.cursor;
+    if (nextExpectedEventNo > eventCount(game.events)) {
+        return;
+    }
+
+    if (nextExpectedEventNo != cursor.acked) {
+        cursor.acked = nextExpectedEventNo;
+        cursor.rtoStart = socks.now;
+    }
+
+    cursor.sent = std::max(cursor.sent, cursor.acked);
+}
+
+// Answers a client's request: events it didn't acknowledge are sent again only
+// after the retransmission timeout, otherwise it gets just the ones it wasn't sent.
+// A client joining the game that asked for keyframes gets the latest one and the tail after it.
+void answerClient(ServerNetworkData &socks, ClientSlot &client, GameState &game, uint32_t nextExpectedEventNo) {
+    DeliveryCursor &cursor = client.cursor;
+    syncCursor(client, game);
+    ackEvents(socks, client, game, nextExpectedEventNo);
+    if (cursor.acked < cursor.sent && socks.now >= cursor.rtoStart + RETRANSMIT_TIMEOUT) {
+        socks.stats.retransmits++;
+        cursor.rtoStart = socks.now;
+        cursor.sent = cursor.acked;
+    }
+
+    bool keyframe = false;
+    if (client.keyframes && cursor.sent == 0) {
+        KeyframeState &kf = getKeyframe(game);
+        if (!kf.parts.empty()) {
+            queueKeyframe(socks, client.sockaddr, game, kf);
+            cursor.sent = kf.events;
+            cursor.rtoStart = socks.now;
+            keyframe = true;
+        }
+    }
+
+    if (queueNewEvents(socks, client, game) || keyframe) {
+        flushEvents(socks);
+    } else {
+        socks.stats.sendsSkipped++;
+    }
+}
+
+// Passes a changed turn direction of a player of the active game to the simulation thread,
+// which applies it before its next tick. The main thread's copy of the game keeps the last
+// direction passed, so a change dropped on a full queue is passed with the client's next message.
+void passTurn(ServerNetworkData &socks, uint32_t room, GameState &game, ClientMsg &msg, ClientInfo &info) {
+    auto it = msg.playerName.empty() ? game.playerPos.end() : game.playerPos.find(info);
+    if (it == game.playerPos.end() || it->second.turnDirection == msg.turnDirection) {
+        return;
+    }
+
+    SimCommand command{room, game.gameId, it->second.order, msg.turnDirection, nullptr};
+    if (pushQueue(socks.sim->commands, std::move(command))) {
+        it->second.turnDirection = msg.turnDirection;
+    } else {
+        addMetric(socks.metrics->droppedInputs, 1);
+    }
+}
+
+// Returns the archived game of the room the client's cursor points at, if the client
+// hasn't acknowledged all of its events yet, NULL otherwise.
+GameState *findCatchUpGame(Room &room, const DeliveryCursor &cursor, uint32_t nextExpectedEventNo) {
+    if (room.game.active && cursor.gameId == room.game.gameId) {
+        return NULL;
+    }
+
+    for (auto it = room.archive.rbegin(); it != room.archive.rend(); it++) {
+        GameState &game = **it;
+        if (game.gameId == cursor.gameId) {
+            return std::max(cursor.acked, nextExpectedEventNo) < eventCount(game.events) ? &game : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the game a client's request is answered from: the archived game it's catching
+// up with, the room's current game, or the last finished one between games.
+GameState &clientGame(Room &room, ClientSlot &client, uint32_t nextExpectedEventNo) {
+    if (GameState *game = findCatchUpGame(room, client.cursor, nextExpectedEventNo)) {
+        return *game;
+    }
+
+    return room.game.active || room.archive.empty() ? room.game : *room.archive.back();
+}
+
+// Validates a single UDP packet received from some client and fills input with
+// its contents, returns false when the packet is invalid.
+bool parseClientInput(const sockaddr_storage &clientAddress, char *buf, ssize_t len, ClientInput &input) {
+    if (!getClientAddr(clientAddress, input.addr, input.sockaddr))
+        return false;
+
+    input.msg = {};
+    return parseClientMsg(buf, len, input.msg) == 0;
+}
+
+// Handles a validated message received from some client.
+void handleClientInput(ServerNetworkData &socks, std::vector<Room> &rooms, ClientInput &input) {
+    const ClientAddr &addr = input.addr;
+    const sockaddr_in6 &sockaddr = input.sockaddr;
+    ClientMsg &msg = input.msg;
+
+    ClientInfo info = {msg.sessionId, msg.playerName, -1, 0, 0};
+    ClientSlot *client = findClient(socks.clientId, addr);
+    if (!client && socks.clientId.size < MAX_SESSIONS) {
+        info.room = chooseRoom(rooms, msg.playerName);
+        if (info.room == -1) {
+            return;
+        }
+
+        client = acceptPlayer(socks, rooms[info.room], addr, sockaddr, info);
+    } else if (client) {
+        if (msg.sessionId < client->info.sessionId) {
+            return;
+        }
+
+        if (msg.sessionId > client->info.sessionId) {
+            info.room = client->info.room;
+            info.wheelTick = client->info.wheelTick;
+            client->info = info;
+            client->cursor = {};
+        }
+
+        renewPlayer(socks, client->info);
+    } else {  
+        return;
+    }
+
+    Room &room = rooms[client->info.room];
+    client->protocol = msg.protocol;
+    client->keyframes = msg.keyframes;
+    if (socks.sim && room.game.active) {
+        passTurn(socks, client->info.room, room.game, msg, client->info);
+    } else {
+        updatePlayerState(room.game, msg, client->info);
+    }
+    answerClient(socks, *client, clientGame(room, *client, msg.nextExpectedEventNo), msg.nextExpectedEventNo);
+}
+
+// Handles a single UDP packet received from some client.
+void handleClientMsg(ServerNetworkData &socks, std::vector<Room> &rooms,
+                     sockaddr_storage &clientAddress, char *buf, ssize_t len) {
+    ClientInput input;
+    if (parseClientInput(clientAddress, buf, len, input)) {
+        handleClientInput(socks, rooms, input);
+    } else {
+        addMetric(socks.metrics->rejectedInputs, 1);
+    }
+}
+
+// Returns the number of bytes waiting in the socket's receive queue.
+uint64_t recvQueueBytes(int sock) {
+    uint32_t meminfo[SK_MEMINFO_VARS] = {};
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == -1) {
+        return 0;
+    }
+
+    return meminfo[SK_MEMINFO_RMEM_ALLOC];
+}
+
+// Reads a batch of at most params.recvBatch UDP packets from sock with a single recvmmsg.
+int receiveBatch(ServerParameters &params, int sock, RecvBatch &batch, int flags) {
+    for (int64_t i = 0; i < params.recvBatch; i++) {
+        batch.iovs[i] = {&batch.bufs[i * MAX_EVENT_SIZE], MAX_EVENT_SIZE};
+        batch.msgs[i].msg_hdr = {};
+        batch.msgs[i].msg_hdr.msg_name = &batch.addrs[i];
+        batch.msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        batch.msgs[i].msg_hdr.msg_iov = &batch.iovs[i];
+        batch.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return recvmmsg(sock, batch.msgs.data(), params.recvBatch, flags, NULL);
+}
+
+// Main loop of a receive thread, it validates datagrams from its socket and passes
+// them to the main thread, waking it up once per batch.
+void runRecvShard(ServerParameters &params, RecvShard &shard, int inputEvent, Metrics &metrics) {
+    RecvBatch &batch = shard.batch;
+    while (true) {
+        int count = receiveBatch(params, shard.sock, batch, MSG_WAITFORONE);
+        shard.recvSyscalls.fetch_add(1, std::memory_order_relaxed);
+        if (count <= 0) {
+            continue;
+        }
+
+        shard.datagramsReceived.fetch_add(count, std::memory_order_relaxed);
+        addMetric(metrics.packetsIn, count);
+        addMetric(metrics.bytesIn, batchBytes(batch.msgs.data(), count));
+        bool pushed = false;
+        for (int i = 0; i < count; i++) {
+            ClientInput input;
+            if (!parseClientInput(batch.addrs[i], &batch.bufs[i * MAX_EVENT_SIZE], batch.msgs[i].msg_len, input)) {
+                shard.rejected.fetch_add(1, std::memory_order_relaxed);
+                addMetric(metrics.rejectedInputs, 1);
+            } else if (!pushQueue(shard.inputs, std::move(input))) {
+                shard.queueDrops.fetch_add(1, std::memory_order_relaxed);
+                addMetric(metrics.droppedInputs, 1);
+            } else {
+                pushed = true;
+            }
+        }
+
+        if (pushed) {
+            uint64_t one = 1;
+            write(inputEvent, &one, sizeof(one));
+        }
+    }
+}
+
+// Starts receive threads of all shards.
+void startRecvThreads(ServerParameters &params, ServerNetworkData &socks) {
+    for (auto &shard : socks.shards) {
+        shard->thread = std::thread(runRecvShard, std::ref(params), std::ref(*shard), socks.inputEvent,
+                                    std::ref(*socks.metrics));
+    }
+}
+
+// Handles messages passed by receive threads, in order of arrival within every shard.
+void handleInputs(ServerNetworkData &socks, std::vector<Room> &rooms) {
+    uint64_t trash;
+    read(socks.inputEvent, &trash, sizeof(trash));
+
+    ClientInput input;
+    for (auto &shard : socks.shards) {
+        while (popQueue(shard->inputs, input)) {
+            handleClientInput(socks, rooms, input);
+        }
+    }
+}
+
+// Reads a batch of at most params.recvBatch UDP packets with a single recvmmsg
+// and handles them in order of arrival.
+void handleConnection(ServerParameters &params, ServerNetworkData &socks, std::vector<Room> &rooms) {
+    RecvBatch &batch = socks.recv;
+    int count = receiveBatch(params, socks.sock, batch, MSG_DONTWAIT);
+    socks.stats.recvSyscalls++;
+    if (count <= 0) {
+        return;
+    }
+
+    socks.stats.datagramsReceived += count;
+    addMetric(socks.metrics->packetsIn, count);
+    addMetric(socks.metrics->bytesIn, batchBytes(batch.msgs.data(), count));
+    socks.stats.maxRecvBatch = std::max(socks.stats.maxRecvBatch, (uint64_t)count);
+    if (count == params.recvBatch) {
+        socks.stats.fullRecvBatches++;
+        socks.stats.maxRecvQueueBytes = std::max(socks.stats.maxRecvQueueBytes, recvQueueBytes(socks.sock));
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (batch.msgs[i].msg_len > 0) {
+            handleClientMsg(socks, rooms, batch.addrs[i], &batch.bufs[i * MAX_EVENT_SIZE], batch.msgs[i].msg_len);
+        }
+    }
+}
+
+// Simulates a single frame of the game's logic.
+void updateGame(ServerParameters &params, GameState &game) {
+    std::vector<ClientInfo> toErase;
+    for (auto &i: game.playerPos) {
+        if (i.second.turnDirection == 1) {
+            i.second.direction += params.turningSpeed;
+            i.second.direction %= 360;
+        } 
+
+        if (i.second.turnDirection == 2) {
+            i.second.direction -= params.turningSpeed;
+            i.second.direction %= 360;
+            if (i.second.direction < 0) i.second.direction += 360;
+        }
+
+        int oldX = getFloor(i.second.x), oldY = getFloor(i.second.y);
+        i.second.x += DIRECTIONS.dx[i.second.direction];
+        i.second.y += DIRECTIONS.dy[i.second.direction];
+
+        int x = getFloor(i.second.x), y = getFloor(i.second.y);
+        if (oldX == x && oldY == y) {
+            continue;
+        } else if (x < 0 || x >= params.width || y < 0 || y >= params.height || testAndSetField(game.eatenFields, x, y)) {
+            createPlayerEliminatedEvent(i.second.order, game);
+            toErase.push_back(i.first);
+            if (game.playerPos.size() - toErase.size() == 1) {
+                createGameOverEvent(game);
+                break;
+            }
+        } else {
+            createPixelEvent(i.second.order, x, y, game);
+        }
+    }
+
+    for (auto i : toErase) {
+        game.playerPos.erase(i);
+    }
+}
+
+// Sends events of active games that weren't sent yet to all clients of their rooms,
+// except the ones still catching up with a finished game.
+void broadcastEvents(ServerNetworkData &socks, std::vector<Room> &rooms) {
+    for (auto &slot : socks.clientId.slots) {
+        if (slot.state != SLOT_USED) {
+            continue;
+        }
+
+        Room &room = rooms[slot.info.room];
+        if (room.game.active && !findCatchUpGame(room, slot.cursor, 0)) {
+            GameState &game = room.game;
+            syncCursor(slot, game);
+            queueNewEvents(socks, slot, game);
+        }
+    }
+
+    flushEvents(socks);
+}
+
+// Queues events of current games that weren't recorded yet, one chunk per room. When
+// the writer falls behind and its queue is full the events are left out of the recording.
+void recordEvents(ServerNetworkData &socks, std::vector<Room> &rooms) {
+    if (!socks.recorder) {
+        return;
+    }
+
+    Recorder &rec = *socks.recorder;
+    bool pushed = false;
+    for (size_t i = 0; i < rooms.size(); i++) {
+        GameState &game = rooms[i].game;
+        uint32_t count = eventCount(game.events);
+        if (game.recorded == count) {
+            continue;
+        }
+
+        RecordChunk chunk{game.gameId, (uint32_t)i, game.recorded, count - game.recorded, realtimeMs(), {}};
+        copyEvents(game.events, game.recorded, chunk.bytes);
+        game.recorded = count;
+        if (pushQueue(rec.chunks, std::move(chunk))) {
+            pushed = true;
+        } else {
+            rec.drops.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    if (pushed) {
+        uint64_t one = 1;
+        write(rec.wakeEvent, &one, sizeof(one));
+    }
+}
+
+// Takes the next task for given worker, from its own queue or stolen from another one.
+std::function<void()> takeTask(WorkerPool &pool, size_t self) {
+    std::function<void()> task;
+    {
+        WorkQueue &own = *pool.queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return task;
+        }
+    }
+
+    for (size_t i = 1; i < pool.queues.size(); i++) {
+        WorkQueue &victim = *pool.queues[(self + i) % pool.queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            pool.steals++;
+            return task;
+        }
+    }
+
+    return task;
+}
+
+// Runs tasks as long as there are any left in the pool's queues.
+void runQueuedTasks(WorkerPool &pool, size_t self) {
+    while (std::function<void()> task = takeTask(pool, self)) {
+        task();
+        if (pool.pending.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.done.notify_all();
+        }
+    }
+}
+
+// Main loop of a worker thread, it runs tasks of every batch queued in the pool.
+void runWorker(WorkerPool &pool, size_t self) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.wake.wait(lock, [&] { return pool.stop || pool.generation != seen; });
+            if (pool.stop) {
+                return;
+            }
+
+            seen = pool.generation;
+        }
+
+        runQueuedTasks(pool, self);
+    }
+}
+
+// Starts count worker threads in the pool.
+void startWorkers(WorkerPool &pool, int count) {
+    for (int i = 0; i <= count; i++) {
+        pool.queues.push_back(std::make_unique<WorkQueue>());
+    }
+
+    for (int i = 1; i <= count; i++) {
+        pool.threads.emplace_back(runWorker, std::ref(pool), i);
+    }
+}
+
+// Stops and joins all worker threads of the pool.
+void stopWorkers(WorkerPool &pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stop = true;
+    }
+
+    pool.wake.notify_all();
+    for (auto &thread : pool.threads) {
+        thread.join();
+    }
+
+    pool.threads.clear();
+}
+
+// Runs a batch of tasks on the pool's threads and the calling one, returns when all are done.
+void runTasks(WorkerPool &pool, std::vector<std::function<void()>> &tasks) {
+    if (tasks.empty()) {
+        return;
+    }
+
+    pool.pending = tasks.size();
+    for (size_t i = 0; i < tasks.size(); i++) {
+        WorkQueue &queue = *pool.queues[i % pool.queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(tasks[i]));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.generation++;
+    }
+
+    pool.wake.notify_all();
+    runQueuedTasks(pool, 0);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.done.wait(lock, [&] { return pool.pending == 0; });
+}
+
+// Returns the number of events in logs of the current games of all rooms.
+uint64_t countEvents(std::vector<Room> &rooms) {
+    uint64_t events = 0;
+    for (auto &room : rooms) {
+        events += eventCount(room.game.events);
+    }
+    return events;
+}
+
+// Records metrics of a frame of ticks simulated together, which took given time
+// and started with eventsBefore events in all rooms.
+void recordTicks(Metrics &metrics, std::vector<Room> &rooms, uint64_t ticks, uint64_t eventsBefore,
+                 uint64_t durationUs) {
+    uint64_t events = 0, bytes = 0;
+    for (auto &room : rooms) {
+        events += eventCount(room.game.events);
+        bytes += room.game.events.bytes;
+    }
+
+    addMetric(metrics.ticks, ticks);
+    observeMetric(metrics.eventsPerTick, (events - eventsBefore) / ticks);
+    observeMetric(metrics.tickDurationUs, durationUs / ticks);
+    observeMetric(metrics.overdueTicks, ticks - 1);
+    setMetric(metrics.eventLogEvents, events);
+    setMetric(metrics.eventLogBytes, bytes);
+    if (ticks > 1) {
+        addMetric(metrics.catchUpFrames, 1);
+        setMetric(metrics.maxOverdueTicks, std::max(metrics.maxOverdueTicks.load(std::memory_order_relaxed), ticks - 1));
+    }
+}
+
+// Returns current counts of the histogram.
+HistogramCounts snapshotHistogram(const Histogram &histogram) {
+    HistogramCounts counts{};
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        counts.buckets[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+    }
+    counts.sum = histogram.sum.load(std::memory_order_relaxed);
+    return counts;
+}
+
+// Prints the mean and upper bounds of buckets holding the median, 99th and 99.9th
+// percentiles of values counted in now but not yet in before.
+void printQuantiles(const char *name, const HistogramCounts &now, const HistogramCounts &before) {
+    uint64_t count = 0;
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        count += now.buckets[i] - before.buckets[i];
+    }
+
+    fprintf(stderr, " %s_mean=%.1f", name, count ? (double)(now.sum - before.sum) / count : 0.0);
+    for (double q : {0.5, 0.99, 0.999}) {
+        uint64_t rank = std::ceil(q * count), seen = 0;
+        int bucket = 0;
+        while (bucket < METRIC_BUCKETS - 1 && (seen += now.buckets[bucket] - before.buckets[bucket]) < rank) {
+            bucket++;
+        }
+        fprintf(stderr, " %s_p%g=%llu", name, q * 100, bucket ? (1ULL << bucket) - 1 : 0ULL);
+    }
+}
+
+// Returns tick loop metrics at given time.
+TickReport snapshotTicks(const Metrics &metrics, uint64_t nowMs) {
+    return {nowMs, metrics.ticks.load(std::memory_order_relaxed), metrics.tickOverruns.load(std::memory_order_relaxed),
+            snapshotHistogram(metrics.tickLatenessUs), snapshotHistogram(metrics.simDurationUs),
+            snapshotHistogram(metrics.sendDurationUs)};
+}
+
+// Prints timing of ticks simulated since the given report: their number, expirations
+// of the game timer missed, the part of tick periods spent simulating and sending
+// and distributions of lateness, simulation and send times of frames in us.
+void printTickReport(const Metrics &metrics, uint64_t periodNs, const TickReport &since, uint64_t nowMs) {
+    TickReport now = snapshotTicks(metrics, nowMs);
+    uint64_t ticks = now.ticks - since.ticks, busyUs = now.sim.sum - since.sim.sum + now.send.sum - since.send.sum;
+    fprintf(stderr, "ticks: seconds=%.1f ticks=%lu overruns=%lu busy=%.3f", (now.timeMs - since.timeMs) / 1000.0,
+            ticks, now.overruns - since.overruns, ticks ? (double)busyUs * 1000 / (ticks * periodNs) : 0.0);
+    printQuantiles("lateness_us", now.lateness, since.lateness);
+    printQuantiles("sim_us", now.sim, since.sim);
+    printQuantiles("send_us", now.send, since.send);
+    fprintf(stderr, "\n");
+}
+
+// Prints the tick report of the last TICK_REPORT_INTERVAL ms once it has passed.
+void reportTicks(TickLoop &loop, const Metrics &metrics, uint64_t nowMs) {
+    if (nowMs >= loop.lastReport.timeMs + TICK_REPORT_INTERVAL) {
+        printTickReport(metrics, loop.periodNs, loop.lastReport, nowMs);
+        loop.lastReport = snapshotTicks(metrics, nowMs);
+    }
+}
+
+// Simulates all expirations of the game timer, overdue ones included, in every active
+// room on the worker pool. Returns the number of ticks, 0 if none expired or no game is
+// active. Lateness of the first tick and the time of the simulation go to metrics.
+uint64_t simulateTicks(ServerParameters &params, TickLoop &loop, Metrics &metrics, std::vector<Room> &rooms,
+                       WorkerPool &pool) {
+    uint64_t ret;
+    int rbytes = read(loop.timer, &ret, sizeof(ret));
+    if (rbytes <= 0 || ret == 0) {
+        return 0;
+    }
+
+    // The first tick of the frame was due with the first of ret expirations read now.
+    uint64_t startNs = monotonicNs(), dueNs = loop.armedNs + (loop.expirations + 1) * loop.periodNs;
+    loop.expirations += ret;
+    addMetric(metrics.tickOverruns, ret - 1);
+
+    std::vector<std::function<void()>> tasks;
+    for (auto &room : rooms) {
+        GameState &game = room.game;
+        if (game.active && game.playerPos.size() >= 2) {
+            tasks.push_back([&params, &game, ret] {
+                for (uint64_t tick = 0; tick < ret && game.playerPos.size() >= 2; tick++) {
+                    updateGame(params, game);
+                }
+            });
+        }
+    }
+
+    if (tasks.empty()) {
+        return 0;
+    }
+
+    runTasks(pool, tasks);
+    observeMetric(metrics.tickLatenessUs, startNs > dueNs ? (startNs - dueNs) / 1000 : 0);
+    observeMetric(metrics.simDurationUs, (monotonicNs() - startNs) / 1000);
+    return ret;
+}
+
+// Simulates every expiration of the game timer of every active room on the worker pool
+// and broadcasts new events to all connected clients. When the loop fell behind, all
+// overdue ticks are simulated first and their events go out packed in one broadcast.
+void handleGameFrame(ServerParameters &params, ServerNetworkData &socks, std::vector<Room> &rooms, WorkerPool &pool) {
+    Metrics &metrics = *socks.metrics;
+    uint64_t startNs = monotonicNs(), eventsBefore = countEvents(rooms);
+    uint64_t ticks = simulateTicks(params, socks.tickLoop, metrics, rooms, pool);
+    if (ticks == 0) {
+        return;
+    }
+
+    uint64_t simulatedNs = monotonicNs();
+    broadcastEvents(socks, rooms);
+    recordEvents(socks, rooms);
+    uint64_t sentNs = monotonicNs();
+
+    observeMetric(metrics.sendDurationUs, (sentNs - simulatedNs) / 1000);
+    recordTicks(metrics, rooms, ticks, eventsBefore, (sentNs - startNs) / 1000);
+    reportTicks(socks.tickLoop, metrics, socks.now);
+}
+
+// Returns a reactor with no registered descriptors.
+Reactor createReactor() {
+    Reactor reactor{};
+    if ((reactor.epollFd = epoll_create1(0)) == -1) {
+        syserr("epoll_create1()");
+    }
+
+    return reactor;
+}
+
+// Registers callback to be run when fd reports any of given epoll events.
+void addHandler(Reactor &reactor, int fd, uint32_t events, ReadyCallback callback) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(reactor.epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        syserr("epoll_ctl()");
+    }
+
+    reactor.callbacks[fd] = std::move(callback);
+}
+
+// Waits at most timeout ms for registered descriptors to become ready,
+// returns the number of ready ones, which are dispatched with dispatchReady.
+int waitReady(Reactor &reactor, int timeout) {
+    int ret = epoll_wait(reactor.epollFd, reactor.ready, MAX_REACTOR_EVENTS, timeout);
+    if (ret == -1) {
+        if (errno != EINTR) {
+            syserr("epoll_wait()");
+        }
+
+        fprintf(stderr, "Interrupted syscall\n");
+        return 0;
+    }
+
+    return ret;
+}
+
+// Runs callbacks of the first count ready descriptors.
+void dispatchReady(Reactor &reactor, int count) {
+    for (int i = 0; i < count; i++) {
+        auto it = reactor.callbacks.find(reactor.ready[i].data.fd);
+        if (it != reactor.callbacks.end()) {
+            it->second(reactor.ready[i].events);
+        }
+    }
+}
+
+// Applies commands of the main thread: starts simulating games handed over to the
+// simulation thread and changes turn directions of their players.
+void applySimCommands(ServerParameters &params, Simulation &sim) {
+    SimCommand command;
+    while (popQueue(sim.commands, command)) {
+        GameState &game = sim.rooms[command.room].game;
+        if (command.game) {
+            game = std::move(*command.game);
+            sim.published[command.room] = eventCount(game.events);
+            if (!sim.tickLoop.armed) {
+                resetGameTimer(params, sim.tickLoop, true);
+            }
+        } else if (game.active && game.gameId == command.gameId) {
+            for (auto &i : game.playerPos) {
+                if (i.second.order == command.order) {
+                    i.second.turnDirection = command.turnDirection;
+                }
+            }
+        }
+    }
+}
+
+// Passes new events of all games to the main thread, the ones that don't fit
+// in the queue are passed after the next frame. Segments of passed events are
+// dropped, the main thread keeps its own copies of the logs.
+void publishEvents(Simulation &sim) {
+    bool pushed = false;
+    for (size_t i = 0; i < sim.rooms.size(); i++) {
+        GameState &game = sim.rooms[i].game;
+        uint32_t count = eventCount(game.events);
+        if (!game.active || sim.published[i] == count) {
+            continue;
+        }
+
+        EventRange range{(uint32_t)i, game.gameId, sim.published[i], count - sim.published[i], {}};
+        copyEvents(game.events, sim.published[i], range.bytes);
+        if (!pushQueue(sim.ranges, std::move(range))) {
+            break;
+        }
+
+        sim.published[i] = count;
+        dropEvents(game.events, count);
+        pushed = true;
+    }
+
+    if (pushed) {
+        uint64_t one = 1;
+        write(sim.rangeEvent, &one, sizeof(one));
+    }
+}
+
+// Simulates a frame on the simulation thread and passes its events to the main thread.
+// Games that are over are dropped once all their events are passed, the game timer
+// stops when there are none left.
+void handleSimFrame(ServerParameters &params, Simulation &sim, Metrics &metrics, WorkerPool &pool) {
+    applySimCommands(params, sim);
+    uint64_t startNs = monotonicNs(), eventsBefore = countEvents(sim.rooms);
+    uint64_t ticks = simulateTicks(params, sim.tickLoop, metrics, sim.rooms, pool);
+    publishEvents(sim);
+    if (ticks != 0) {
+        recordTicks(metrics, sim.rooms, ticks, eventsBefore, (monotonicNs() - startNs) / 1000);
+        reportTicks(sim.tickLoop, metrics, monotonicMs());
+    }
+
+    bool anyActive = false;
+    for (size_t i = 0; i < sim.rooms.size(); i++) {
+        GameState &game = sim.rooms[i].game;
+        if (game.active && game.playerPos.size() < 2 && sim.published[i] == eventCount(game.events)) {
+            game = GameState{};
+        }
+        anyActive |= game.active;
+    }
+
+    if (!anyActive && sim.tickLoop.armed) {
+        resetGameTimer(params, sim.tickLoop, false);
+    }
+}
+
+// Runs the simulation thread's event loop, woken up by the game timer and by games handed over.
+void runSimulation(ServerParameters &params, Simulation &sim, Metrics &metrics, WorkerPool &pool) {
+    Reactor reactor = createReactor();
+    addHandler(reactor, sim.commandEvent, EPOLLIN | EPOLLET, [&](uint32_t) {
+        uint64_t trash;
+        read(sim.commandEvent, &trash, sizeof(trash));
+        applySimCommands(params, sim);
+    });
+    addHandler(reactor, sim.tickLoop.timer, EPOLLIN | EPOLLET, [&](uint32_t) {
+        handleSimFrame(params, sim, metrics, pool);
+    });
+
+    while (true) {
+        dispatchReady(reactor, waitReady(reactor, -1));
+    }
+}
+
+// Starts the simulation thread, the worker pool is used only by it from now on.
+void startSimulation(ServerParameters &params, ServerNetworkData &socks, WorkerPool &pool) {
+    socks.sim = std::make_unique<Simulation>();
+    Simulation &sim = *socks.sim;
+    sim.rooms.resize(params.rooms);
+    sim.published.resize(params.rooms);
+    sim.tickLoop = createTickLoop(socks.tickLoop.startMs);
+    initQueue(sim.commands, SIM_QUEUE_SIZE);
+    initQueue(sim.ranges, SIM_QUEUE_SIZE);
+    if ((sim.commandEvent = eventfd(0, EFD_NONBLOCK)) == -1 || (sim.rangeEvent = eventfd(0, EFD_NONBLOCK)) == -1) {
+        syserr("eventfd()");
+    }
+
+    sim.thread = std::thread(runSimulation, std::ref(params), std::ref(sim), std::ref(*socks.metrics), std::ref(pool));
+}
+
+// Hands a game that has just started over to the simulation thread, waiting for room in its queue.
+void handOverGame(ServerNetworkData &socks, uint32_t room, GameState &game) {
+    auto copy = std::make_unique<GameState>();
+    copy->active = true;
+    setGameId(*copy, game.gameId);
+    for (uint32_t i = 0; i < eventCount(game.events); i++) {
+        appendEvent(copy->events, eventData(game.events, i), eventSize(game.events, i));
+    }
+    copy->eatenFields = std::move(game.eatenFields);
+    copy->playerPos = game.playerPos;
+
+    Simulation &sim = *socks.sim;
+    SimCommand command{room, game.gameId, 0, 0, std::move(copy)};
+    while (!pushQueue(sim.commands, std::move(command))) {
+        std::this_thread::yield();
+    }
+
+    uint64_t one = 1;
+    write(sim.commandEvent, &one, sizeof(one));
+}
+
+// Appends wrapped events passed by the simulation thread to the game's log and removes
+// players they eliminate, just like the simulation did.
+void appendEvents(GameState &game, const std::vector<char> &bytes) {
+    for (size_t offset = 0; offset < bytes.size(); offset += getBigEndian(bytes.data() + offset, 4) + 8) {
+        appendEvent(game.events, bytes.data() + offset, getBigEndian(bytes.data() + offset, 4) + 8);
+        if (bytes[offset + 8] != PLAYER_ELIMINATED_EVENT) {
+            continue;
+        }
+
+        for (auto it = game.playerPos.begin(); it != game.playerPos.end(); it++) {
+            if (it->second.order == (uint8_t)bytes[offset + 9]) {
+                game.playerPos.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+// Appends events passed by the simulation thread to logs of their games and broadcasts them.
+void handleEventRanges(ServerNetworkData &socks, std::vector<Room> &rooms) {
+    Simulation &sim = *socks.sim;
+    uint64_t trash;
+    read(sim.rangeEvent, &trash, sizeof(trash));
+
+    EventRange range;
+    bool appended = false;
+    while (popQueue(sim.ranges, range)) {
+        GameState &game = rooms[range.room].game;
+        if (game.active && game.gameId == range.gameId && range.firstEvent == eventCount(game.events)) {
+            appendEvents(game, range.bytes);
+            appended = true;
+        }
+    }
+
+    if (appended) {
+        uint64_t startNs = monotonicNs();
+        broadcastEvents(socks, rooms);
+        recordEvents(socks, rooms);
+        observeMetric(socks.metrics->sendDurationUs, (monotonicNs() - startNs) / 1000);
+    }
+}
+
+// Registers server's descriptors in the reactor. The socket is level triggered as it
+// may be left with unread datagrams after a full batch, the game timer (or the simulation
+// thread's event counter) and the receive threads' event counter are edge triggered
+// since they are read at once.
+void setupReactor(Reactor &reactor, ServerParameters &params, ServerNetworkData &socks,
+                  std::vector<Room> &rooms, WorkerPool &pool) {
+    if (socks.shards.empty()) {
+        addHandler(reactor, socks.sock, EPOLLIN, [&](uint32_t) {
+            handleConnection(params, socks, rooms);
+        });
+    } else {
+        addHandler(reactor, socks.inputEvent, EPOLLIN | EPOLLET, [&](uint32_t) {
+            handleInputs(socks, rooms);
+        });
+    }
+
+    if (socks.sim) {
+        addHandler(reactor, socks.sim->rangeEvent, EPOLLIN | EPOLLET, [&](uint32_t) {
+            handleEventRanges(socks, rooms);
+        });
+    } else {
+        addHandler(reactor, socks.tickLoop.timer, EPOLLIN | EPOLLET, [&](uint32_t) {
+            handleGameFrame(params, socks, rooms, pool);
+        });
+    }
+}
+
+// Drops the game's cached protocol v2 pages that end at or before event before.
+void dropCompactPages(GameState &game, uint32_t before) {
+    for (auto it = game.compactPages.begin(); it != game.compactPages.end();) {
+        if (it->second.to <= before) {
+            game.compactBytes -= it->second.bytes.capacity();
+            it = game.compactPages.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+// Sums up protocol v2 pages cached for the current and archived games of all rooms.
+void countCompactPages(SegmentStore &store, std::vector<Room> &rooms) {
+    store.pageBytes = 0;
+    for (auto &room : rooms) {
+        store.pageBytes += room.game.compactBytes;
+        for (auto &game : room.archive) {
+            store.pageBytes += game->compactBytes;
+        }
+    }
+}
+
+// Evicts protocol v2 pages of all games that every client of the game has acknowledged,
+// or all of them with acked false. Pages are packed again when they're asked for.
+void evictCompactPages(ServerNetworkData &socks, std::vector<Room> &rooms, bool acked) {
+    std::unordered_map<uint32_t, uint32_t> cursors;
+    for (auto &slot : socks.clientId.slots) {
+        if (slot.state == SLOT_USED && acked) {
+            auto it = cursors.emplace(slot.cursor.gameId, slot.cursor.acked).first;
+            it->second = std::min(it->second, slot.cursor.acked);
+        }
+    }
+
+    auto evict = [&](GameState &game) {
+        auto it = cursors.find(game.gameId);
+        dropCompactPages(game, acked && it != cursors.end() ? it->second : UINT32_MAX);
+    };
+    for (auto &room : rooms) {
+        evict(room.game);
+        for (auto &game : room.archive) {
+            evict(*game);
+        }
+    }
+    countCompactPages(*socks.logStore, rooms);
+}
+
+// Settles event logs of all rooms and brings them with cached pages under the budget: pages
+// acknowledged by all clients go first, then sealed segments are spilled and if that's not
+// enough, the remaining pages are dropped too. All queued datagrams are flushed by now.
+void trimEventLogs(ServerNetworkData &socks, std::vector<Room> &rooms) {
+    SegmentStore &store = *socks.logStore;
+    for (auto &room : rooms) {
+        settleEventLog(room.game.events);
+    }
+    countCompactPages(store, rooms);
+    if (store.resident + store.pageBytes > store.budget) {
+        evictCompactPages(socks, rooms, true);
+    }
+    trimSegments(store);
+    if (store.resident + store.pageBytes > store.budget) {
+        evictCompactPages(socks, rooms, false);
+    }
+    setMetric(socks.metrics->logResidentBytes, store.resident);
+    setMetric(socks.metrics->logPageBytes, store.pageBytes);
+    setMetric(socks.metrics->logSpills, store.spills);
+    setMetric(socks.metrics->logPageIns, store.pageIns);
+}
+
+// Copies statistics of the main thread to metrics, where the metrics thread can read them.
+void publishStats(ServerNetworkData &socks) {
+    ServerStats &stats = socks.stats;
+    Metrics &metrics = *socks.metrics;
+    setMetric(metrics.pageHits, stats.pageHits);
+    setMetric(metrics.pageMisses, stats.pageMisses);
+    setMetric(metrics.pageBytesSaved, stats.pageBytesSaved);
+    setMetric(metrics.sendSyscalls, stats.sendSyscalls);
+    setMetric(metrics.datagramsSent, stats.datagramsSent);
+    setMetric(metrics.datagramsDropped, stats.datagramsDropped);
+    setMetric(metrics.recvSyscalls, stats.recvSyscalls);
+    setMetric(metrics.datagramsReceived, stats.datagramsReceived);
+    setMetric(metrics.maxRecvBatch, stats.maxRecvBatch);
+    setMetric(metrics.fullRecvBatches, stats.fullRecvBatches);
+    setMetric(metrics.maxRecvQueueBytes, stats.maxRecvQueueBytes);
+    setMetric(metrics.retransmits, stats.retransmits);
+    setMetric(metrics.sendsSkipped, stats.sendsSkipped);
+    setMetric(metrics.keyframesSent, stats.keyframesSent);
+}
+
+// Waits for the next events and dispatches server operations according to them.
+void handlePollEvent(ServerNetworkData &socks, Reactor &reactor, std::vector<Room> &rooms) {
+    int ready = waitReady(reactor, getPollTimeout(socks));
+    socks.now = monotonicMs();
+    handleTimeouts(socks, rooms);
+    dispatchReady(reactor, ready);
+    trimEventLogs(socks, rooms);
+    publishStats(socks);
+}
+
+// Generates the first frame of a new game.
+void startGame(ServerParameters &params, GameState &game, uint64_t &rng) {
+    setGameId(game, getNextRand(rng));
+    game.active = true;
+    resetBoard(game.eatenFields, params.width, params.height);
+    createNewGameEvent(params, game);
+
+    std::vector<ClientInfo> toErase;
+    int order = 0;
+    for (auto &i : game.playerPos) {
+        i.second.order = order++;
+        i.second.x = (int64_t)(getNextRand(rng) % params.width) * FIXED_ONE + FIXED_HALF;
+        i.second.y = (int64_t)(getNextRand(rng) % params.height) * FIXED_ONE + FIXED_HALF;
+        i.second.direction = getNextRand(rng) % 360;
+
+        int x = getFloor(i.second.x);
+        int y = getFloor(i.second.y);
+        if (testAndSetField(game.eatenFields, x, y)) {
+            createPlayerEliminatedEvent(i.second.order, game);
+            if (game.playerPos.size() - toErase.size() == 1) {
+                createGameOverEvent(game);
+                toErase.push_back(i.first);
+                break;
+            }
+        } else {
+            createPixelEvent(i.second.order, x, y, game);
+        }
+    }
+
+    for (auto i : toErase) {
+        game.playerPos.erase(i);
+    }
+}
+
+// Prints server statistics to stderr.
+void printStats(ServerNetworkData &socks) {
+    ServerStats &stats = socks.stats;
+    uint64_t lookups = stats.pageHits + stats.pageMisses;
+    fprintf(stderr, "page cache: hits=%lu misses=%lu hit_rate=%.3f bytes_saved=%lu\n",
+            stats.pageHits, stats.pageMisses, lookups ? (double)stats.pageHits / lookups : 0.0,
+            stats.pageBytesSaved);
+    fprintf(stderr, "send: syscalls=%lu datagrams=%lu dropped=%lu\n",
+            stats.sendSyscalls, stats.datagramsSent, stats.datagramsDropped);
+    fprintf(stderr, "recv: syscalls=%lu datagrams=%lu avg_batch=%.2f max_batch=%lu full_batches=%lu max_queue_bytes=%lu\n",
+            stats.recvSyscalls, stats.datagramsReceived,
+            stats.recvSyscalls ? (double)stats.datagramsReceived / stats.recvSyscalls : 0.0,
+            stats.maxRecvBatch, stats.fullRecvBatches, stats.maxRecvQueueBytes);
+    fprintf(stderr, "delivery: retransmits=%lu skipped=%lu keyframes=%lu\n", stats.retransmits, stats.sendsSkipped,
+            stats.keyframesSent);
+    fprintf(stderr, "event logs: resident_bytes=%lu page_bytes=%lu spills=%lu page_ins=%lu\n",
+            socks.metrics->logResidentBytes.load(), socks.metrics->logPageBytes.load(), socks.metrics->logSpills.load(),
+            socks.metrics->logPageIns.load());
+    fprintf(stderr, "ticks: catch_up_frames=%lu max_overdue=%lu\n", socks.metrics->catchUpFrames.load(),
+            socks.metrics->maxOverdueTicks.load());
+    for (size_t i = 0; i < socks.shards.size(); i++) {
+        RecvShard &shard = *socks.shards[i];
+        fprintf(stderr, "recv thread %zu: syscalls=%lu datagrams=%lu rejected=%lu queue_drops=%lu\n", i,
+                shard.recvSyscalls.load(), shard.datagramsReceived.load(), shard.rejected.load(), shard.queueDrops.load());
+    }
+    if (socks.recorder) {
+        Recorder &rec = *socks.recorder;
+        fprintf(stderr, "recording: chunks=%lu bytes=%lu drops=%lu files=%lu\n", rec.chunksWritten.load(),
+                rec.bytesWritten.load(), rec.drops.load(), rec.files.load());
+    }
+}
+
+// Returns rooms hosted by the server, the first one uses the seed given to the
+// server as is, the others ones derived from it.
+std::vector<Room> createRooms(ServerParameters &params) {
+    std::vector<Room> rooms(params.rooms);
+    for (size_t i = 0; i < rooms.size(); i++) {
+        rooms[i].rng = params.rng ^ ((i * 2654435761ULL) & UINT32_MAX);
+    }
+
+    return rooms;
+}
+
+// Moves the room's game that has just ended to its archive, together with its cached datagrams,
+// and prepares the next one. The oldest archived game is dropped when there are too many.
+// The log won't grow anymore, so its last segment can be spilled too.
+void archiveGame(ServerParameters &params, Room &room) {
+    sealLastSegment(room.game.events);
+    settleEventLog(room.game.events);
+    room.game.eatenFields = {};
+    room.game.playerPos.clear();
+    room.game.readyPlayers.clear();
+    room.archive.push_back(std::make_shared<GameState>(std::move(room.game)));
+    if ((int64_t)room.archive.size() > params.archivedGames) {
+        room.archive.pop_front();
+    }
+
+    room.game = GameState{};
+}
+
+// Starts games in rooms where all players are ready, and finishes the ones where
+// at most one player is left. Started games are handed over to the simulation thread
+// if there is one, otherwise the game timer runs only while some game is active.
+void updateRooms(ServerParameters &params, ServerNetworkData &socks, std::vector<Room> &rooms) {
+    bool anyActive = false;
+    for (size_t i = 0; i < rooms.size(); i++) {
+        Room &room = rooms[i];
+        if (room.game.active && room.game.playerPos.size() < 2) {
+            room.game.active = false;
+            archiveGame(params, room);
+        }
+
+        if (!room.game.active && room.usedNames.size() >= 2 && room.game.readyPlayers.size() >= room.usedNames.size()) {
+            room.game.events.store = socks.logStore.get();
+            startGame(params, room.game, room.rng);
+            broadcastEvents(socks, rooms);
+            recordEvents(socks, rooms);
+            if (room.game.playerPos.size() < 2) {
+                room.game.active = false;
+                archiveGame(params, room);
+            } else if (socks.sim) {
+                handOverGame(socks, i, room.game);
+            } else if (!socks.tickLoop.armed) {
+                resetGameTimer(params, socks.tickLoop, true);
+            }
+        }
+
+        anyActive |= room.game.active;
+    }
+
+    if (!anyActive && socks.tickLoop.armed) {
+        resetGameTimer(params, socks.tickLoop, false);
+    }
+}
+
+// Appends a metric in the Prometheus text format to out.
+void formatMetric(std::string &out, const char *name, const char *type, uint64_t value) {
+    out += std::string("# TYPE screen_worms_") + name + " " + type + "\n";
+    out += std::string("screen_worms_") + name + " " + std::to_string(value) + "\n";
+}
+
+// Appends a histogram in the Prometheus text format to out.
+void formatHistogram(std::string &out, const char *name, const Histogram &histogram) {
+    std::string prefix = std::string("screen_worms_") + name;
+    out += "# TYPE " + prefix + " histogram\n";
+    uint64_t count = 0;
+    for (int i = 0; i < METRIC_BUCKETS - 1; i++) {
+        count += histogram.buckets[i].load(std::memory_order_relaxed);
+        out += prefix + "_bucket{le=\"" + std::to_string((1ULL << i) - 1) + "\"} " + std::to_string(count) + "\n";
+    }
+
+    count += histogram.buckets[METRIC_BUCKETS - 1].load(std::memory_order_relaxed);
+    out += prefix + "_bucket{le=\"+Inf\"} " + std::to_string(count) + "\n";
+    out += prefix + "_sum " + std::to_string(histogram.sum.load(std::memory_order_relaxed)) + "\n";
+    out += prefix + "_count " + std::to_string(count) + "\n";
+}
+
+// Returns a text snapshot of all metrics.
+std::string formatMetrics(const Metrics &metrics) {
+    std::string out;
+    formatMetric(out, "packets_in_total", "counter", metrics.packetsIn.load(std::memory_order_relaxed));
+    formatMetric(out, "bytes_in_total", "counter", metrics.bytesIn.load(std::memory_order_relaxed));
+    formatMetric(out, "packets_out_total", "counter", metrics.packetsOut.load(std::memory_order_relaxed));
+    formatMetric(out, "bytes_out_total", "counter", metrics.bytesOut.load(std::memory_order_relaxed));
+    formatMetric(out, "rejected_inputs_total", "counter", metrics.rejectedInputs.load(std::memory_order_relaxed));
+    formatMetric(out, "dropped_inputs_total", "counter", metrics.droppedInputs.load(std::memory_order_relaxed));
+    formatMetric(out, "sessions", "gauge", metrics.sessions.load(std::memory_order_relaxed));
+    formatMetric(out, "ticks_total", "counter", metrics.ticks.load(std::memory_order_relaxed));
+    formatMetric(out, "event_log_events", "gauge", metrics.eventLogEvents.load(std::memory_order_relaxed));
+    formatMetric(out, "event_log_bytes", "gauge", metrics.eventLogBytes.load(std::memory_order_relaxed));
+    formatMetric(out, "event_log_resident_bytes", "gauge", metrics.logResidentBytes.load(std::memory_order_relaxed));
+    formatMetric(out, "event_log_page_bytes", "gauge", metrics.logPageBytes.load(std::memory_order_relaxed));
+    formatMetric(out, "event_log_spills_total", "counter", metrics.logSpills.load(std::memory_order_relaxed));
+    formatMetric(out, "event_log_page_ins_total", "counter", metrics.logPageIns.load(std::memory_order_relaxed));
+    formatHistogram(out, "events_per_tick", metrics.eventsPerTick);
+    formatHistogram(out, "tick_duration_us", metrics.tickDurationUs);
+    formatHistogram(out, "overdue_ticks", metrics.overdueTicks);
+    formatMetric(out, "tick_overruns_total", "counter", metrics.tickOverruns.load(std::memory_order_relaxed));
+    formatHistogram(out, "tick_lateness_us", metrics.tickLatenessUs);
+    formatHistogram(out, "sim_duration_us", metrics.simDurationUs);
+    formatHistogram(out, "send_duration_us", metrics.sendDurationUs);
+    formatMetric(out, "catch_up_frames_total", "counter", metrics.catchUpFrames.load(std::memory_order_relaxed));
+    formatMetric(out, "max_overdue_ticks", "gauge", metrics.maxOverdueTicks.load(std::memory_order_relaxed));
+    formatMetric(out, "page_cache_hits_total", "counter", metrics.pageHits.load(std::memory_order_relaxed));
+    formatMetric(out, "page_cache_misses_total", "counter", metrics.pageMisses.load(std::memory_order_relaxed));
+    formatMetric(out, "page_cache_bytes_saved_total", "counter", metrics.pageBytesSaved.load(std::memory_order_relaxed));
+    formatMetric(out, "send_syscalls_total", "counter", metrics.sendSyscalls.load(std::memory_order_relaxed));
+    formatMetric(out, "datagrams_sent_total", "counter", metrics.datagramsSent.load(std::memory_order_relaxed));
+    formatMetric(out, "datagrams_dropped_total", "counter", metrics.datagramsDropped.load(std::memory_order_relaxed));
+    formatMetric(out, "recv_syscalls_total", "counter", metrics.recvSyscalls.load(std::memory_order_relaxed));
+    formatMetric(out, "datagrams_received_total", "counter", metrics.datagramsReceived.load(std::memory_order_relaxed));
+    formatMetric(out, "max_recv_batch", "gauge", metrics.maxRecvBatch.load(std::memory_order_relaxed));
+    formatMetric(out, "full_recv_batches_total", "counter", metrics.fullRecvBatches.load(std::memory_order_relaxed));
+    formatMetric(out, "max_recv_queue_bytes", "gauge", metrics.maxRecvQueueBytes.load(std::memory_order_relaxed));
+    formatMetric(out, "retransmits_total", "counter", metrics.retransmits.load(std::memory_order_relaxed));
+    formatMetric(out, "sends_skipped_total", "counter", metrics.sendsSkipped.load(std::memory_order_relaxed));
+    formatMetric(out, "keyframes_sent_total", "counter", metrics.keyframesSent.load(std::memory_order_relaxed));
+    return out;
+}
+
+// Writes a snapshot of the metrics to every client connecting to the listening socket.
+void serveMetrics(int listenSock, const Metrics &metrics) {
+    while (true) {
+        int sock = accept(listenSock, NULL, NULL);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            syserr("accept()");
+        }
+
+        std::string snapshot = formatMetrics(metrics);
+        size_t written = 0;
+        while (written < snapshot.size()) {
+            ssize_t ret = send(sock, snapshot.data() + written, snapshot.size() - written, MSG_NOSIGNAL);
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            } else if (ret <= 0) {
+                break;
+            }
+            written += ret;
+        }
+
+        close(sock);
+    }
+}
+
+// Listens on a UNIX socket at params.metricsPath and serves metrics on it from a separate thread.
+void startMetricsServer(ServerParameters &params, ServerNetworkData &socks) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(params.metricsPath) >= sizeof(addr.sun_path)) {
+        fatal("Metrics socket path is too long");
+    }
+    strcpy(addr.sun_path, params.metricsPath);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        syserr("Opening metrics socket");
+    }
+
+    unlink(params.metricsPath);
+    if (bind(sock, (sockaddr *)&addr, sizeof(addr)) == -1) {
+        syserr("Binding metrics socket");
+    }
+    if (listen(sock, METRICS_BACKLOG) == -1) {
+        syserr("listen()");
+    }
+
+    std::thread(serveMetrics, sock, std::cref(*socks.metrics)).detach();
+}
+
+// Creates and maps the next recording file, then removes files that are too old to be kept.
+// The file appears under its final name only once its header is complete.
+void openRecordingFile(Recorder &rec) {
+    rec.sequence++;
+    std::string path = recordingPath(rec.dir, rec.sequence), tmpPath = path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        syserr("open(%s)", tmpPath.c_str());
+    }
+    if (ftruncate(fd, rec.fileSize) == -1) {
+        syserr("ftruncate(%s)", tmpPath.c_str());
+    }
+
+    void *map = mmap(NULL, rec.fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        syserr("mmap(%s)", tmpPath.c_str());
+    }
+    close(fd);
+
+    RecordingHeader *header = (RecordingHeader *)map;
+    memcpy(header->magic, RECORDING_MAGIC, sizeof(header->magic));
+    header->version = RECORDING_VERSION;
+    header->indexCapacity = rec.fileSize / RECORDING_INDEX_RATIO;
+    header->sequence = rec.sequence;
+    header->fileSize = rec.fileSize;
+    header->dataStart = sizeof(RecordingHeader) + header->indexCapacity * sizeof(RecordingEntry);
+    header->dataEnd = header->dataStart;
+    if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+        syserr("rename(%s)", tmpPath.c_str());
+    }
+
+    rec.file = header;
+    rec.files.fetch_add(1, std::memory_order_relaxed);
+    if (rec.sequence > (uint64_t)rec.maxFiles) {
+        unlink(recordingPath(rec.dir, rec.sequence - rec.maxFiles).c_str());
+    }
+}
+
+// Marks the current recording file as closed for readers following it and unmaps it.
+void closeRecordingFile(Recorder &rec) {
+    __atomic_store_n(&rec.file->closed, 1, __ATOMIC_RELEASE);
+    munmap(rec.file, rec.fileSize);
+    rec.file = NULL;
+}
+
+// Appends the chunk to the current recording file and publishes it in the index,
+// moving on to the next file when it doesn't fit.
+void writeChunk(Recorder &rec, const RecordChunk &chunk) {
+    RecordingHeader *header = rec.file;
+    if (header->indexCount == header->indexCapacity || header->dataEnd + chunk.bytes.size() > header->fileSize) {
+        if (header->dataStart + chunk.bytes.size() > header->fileSize) {
+            rec.drops.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        closeRecordingFile(rec);
+        openRecordingFile(rec);
+        header = rec.file;
+    }
+
+    memcpy((char *)header + header->dataEnd, chunk.bytes.data(), chunk.bytes.size());
+    recordingIndex(header)[header->indexCount] = {chunk.gameId, chunk.room, chunk.firstEvent, chunk.events,
+                                                  header->dataEnd, (uint32_t)chunk.bytes.size(), 0, chunk.timeMs};
+    __atomic_store_n(&header->dataEnd, header->dataEnd + chunk.bytes.size(), __ATOMIC_RELEASE);
+    __atomic_store_n(&header->indexCount, header->indexCount + 1, __ATOMIC_RELEASE);
+    rec.chunksWritten.fetch_add(1, std::memory_order_relaxed);
+    rec.bytesWritten.fetch_add(chunk.bytes.size(), std::memory_order_relaxed);
+}
+
+// Main loop of the recording writer, it writes queued chunks whenever it is woken up
+// and closes the current file when it's stopped.
+void runRecorder(Recorder &rec) {
+    RecordChunk chunk;
+    while (true) {
+        uint64_t trash;
+        if (read(rec.wakeEvent, &trash, sizeof(trash)) == -1 && errno != EINTR) {
+            syserr("read(recording event)");
+        }
+
+        while (popQueue(rec.chunks, chunk)) {
+            writeChunk(rec, chunk);
+        }
+
+        if (rec.stopping.load(std::memory_order_acquire)) {
+            closeRecordingFile(rec);
+            return;
+        }
+    }
+}
+
+// Opens the first recording file in params.recordingDir, numbered after the files
+// already there, removes files beyond the limit and starts the writer thread.
+void startRecorder(ServerParameters &params, ServerNetworkData &socks) {
+    if (mkdir(params.recordingDir, 0755) == -1 && errno != EEXIST) {
+        syserr("mkdir(%s)", params.recordingDir);
+    }
+
+    socks.recorder = std::make_unique<Recorder>();
+    Recorder &rec = *socks.recorder;
+    rec.dir = params.recordingDir;
+    rec.maxFiles = params.recordingFiles;
+    rec.fileSize = (uint64_t)params.recordingFileSize << 20;
+    std::vector<uint64_t> sequences = listRecordings(rec.dir);
+    rec.sequence = sequences.empty() ? 0 : sequences.back();
+    for (uint64_t sequence : sequences) {
+        if (sequence + rec.maxFiles <= rec.sequence + 1) {
+            unlink(recordingPath(rec.dir, sequence).c_str());
+        }
+    }
+
+    initQueue(rec.chunks, RECORDING_QUEUE_SIZE);
+    if ((rec.wakeEvent = eventfd(0, 0)) == -1) {
+        syserr("eventfd()");
+    }
+
+    openRecordingFile(rec);
+    rec.thread = std::thread(runRecorder, std::ref(rec));
+}
+
+// Waits for the writer to write all queued chunks and close the current file,
+// so that readers following the recording know it won't grow anymore.
+void stopRecorder(Recorder &rec) {
+    rec.stopping.store(true, std::memory_order_release);
+    uint64_t one = 1;
+    write(rec.wakeEvent, &one, sizeof(one));
+    rec.thread.join();
+}
+
+#ifndef SCREEN_WORMS_NO_MAIN
+// Blocks SIGINT and SIGTERM in the calling thread and the ones it starts later and
+// returns a signalfd reporting them, so that the event loop can handle them.
+int setupSignals() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        syserr("pthread_sigmask()");
+    }
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK);
+    if (fd == -1) {
+        syserr("signalfd()");
+    }
+
+    return fd;
+}
+
+// Prints timing of all ticks and server statistics, closes the recording and terminates the server.
+void shutdownServer(ServerParameters &params, ServerNetworkData &socks, int signalFd) {
+    signalfd_siginfo info{};
+    read(signalFd, &info, sizeof(info));
+    fprintf(stderr, "server: terminated by signal %u\n", info.ssi_signo);
+
+    TickReport total{};
+    total.timeMs = socks.tickLoop.startMs;
+    printTickReport(*socks.metrics, 1000000000 / params.rps, total, monotonicMs());
+    printStats(socks);
+    if (socks.recorder) {
+        stopRecorder(*socks.recorder);
+    }
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    // Set server params to default values.
+    ServerParameters params = {(uint64_t)time(NULL) & UINT32_MAX, DEFAULT_TURNING_SPEED,
+                               DEFAULT_RPS, DEFAULT_SERVER_PORT, DEFAULT_WIDTH, DEFAULT_HEIGHT,
+                               DEFAULT_RECV_BATCH, DEFAULT_ROOMS, DEFAULT_WORKERS, DEFAULT_RECV_THREADS, NULL,
+                               NULL, DEFAULT_RECORDING_FILES, DEFAULT_RECORDING_FILE_SIZE, DEFAULT_SIM_THREADS,
+                               DEFAULT_ARCHIVED_GAMES, DEFAULT_LOG_BUDGET};
+
+    // Update params with shell options that user has provided.
+    getOptions(argc, argv, params);
+
+    // Signals are blocked before any thread starts, so only the main thread handles them.
+    int signalFd = setupSignals();
+
+    // Prepare sockets for UDP communication.
+    ServerNetworkData socks{};
+    socks = setupSockets(params);
+
+    startRecvThreads(params, socks);
+    if (params.metricsPath) {
+        startMetricsServer(params, socks);
+    }
+    if (params.recordingDir) {
+        startRecorder(params, socks);
+    }
+
+    std::vector<Room> rooms = createRooms(params);
+    WorkerPool pool{};
+    startWorkers(pool, params.workers);
+    if (params.simThreads) {
+        startSimulation(params, socks, pool);
+    }
+
+    Reactor reactor = createReactor();
+    setupReactor(reactor, params, socks, rooms, pool);
+    addHandler(reactor, signalFd, EPOLLIN, [&](uint32_t) {
+        shutdownServer(params, socks, signalFd);
+    });
+
+    // Server is meant to run indefinitely, every room starts a new game as soon as its players are ready.
+    while (true) {
+        handlePollEvent(socks, reactor, rooms);
+        updateRooms(params, socks, rooms);
+    }
+}
+#endif // SCREEN_WORMS_NO_MAIN
@@ -2,6 +2,22 @@
 #define SCREEN_WORMS_SERVER_H
 
 #include "common.h"
+#include "recording.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/sock_diag.h>
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
 
 #define MAX_SEED UINT32_MAX
 
@@ -13,29 +29,126 @@
 #define DEFAULT_RPS 50
 #define MAX_RPS 250
 
-#define GAME_TIMER_ID MAX_PLAYERS + 1
+#define MAX_REACTOR_EVENTS 16
+
+#define MIN_ROOMS 1
+#define DEFAULT_ROOMS 1
+#define MAX_ROOMS 4096
+
+#define MIN_WORKERS 0
+#define DEFAULT_WORKERS 0
+#define MAX_WORKERS 256
+
+#define MIN_RECV_THREADS 0
+#define DEFAULT_RECV_THREADS 0
+#define MAX_RECV_THREADS 64
+
+#define MIN_SIM_THREADS 0
+#define DEFAULT_SIM_THREADS 0
+#define MAX_SIM_THREADS 1
+
+#define MIN_ARCHIVED_GAMES 1
+#define DEFAULT_ARCHIVED_GAMES 4
+#define MAX_ARCHIVED_GAMES 1024
+
+// Memory budget of event logs in MiB, segments above it are spilled to disk.
+#define MIN_LOG_BUDGET 1
+#define DEFAULT_LOG_BUDGET 1024
+#define MAX_LOG_BUDGET (1 << 20)
+
+// Size of a segment of an event log, events never straddle two segments.
+#define LOG_SEGMENT_SIZE (64 * 1024)
+
+// Capacity of the queue of parsed messages passed from a receive thread to the main one.
+#define INPUT_QUEUE_SIZE 4096
+
+// Number of power of two buckets of metric histograms.
+#define METRIC_BUCKETS 32
+#define METRICS_BACKLOG 16
+
+#define RECORDING_QUEUE_SIZE 4096
+
+// Capacity of the queues between the main thread and the simulation thread.
+#define SIM_QUEUE_SIZE 4096
+
+// Interval of reports of the tick loop's timing, in ms.
+#define TICK_REPORT_INTERVAL 10000
+
+#define MIN_RECV_BATCH 1
+#define DEFAULT_RECV_BATCH 64
+#define MAX_RECV_BATCH 1024
 
 #define MIN_CLIENT_MSG_SIZE 13
 #define MAX_CLIENT_MSG_SIZE 33
 
 #define CLIENT_TIMEOUT 2
 
+// Sessions (players and spectators) the server keeps at once, at most MAX_PLAYERS of them can play.
+#define MAX_SESSIONS 65536
+
+// Client timeouts are checked every WHEEL_TICK ms, the wheel spans WHEEL_SLOTS ticks,
+// which must be more than CLIENT_TIMEOUT.
+#define WHEEL_TICK 50
+#define WHEEL_SLOTS 64
+
+// How many times and for how long (in ms) to wait for a full socket buffer when sending.
+#define SEND_RETRIES 3
+#define SEND_RETRY_TIMEOUT 1
+
+// Time (in ms) without progress of a client's acknowledgements after which
+// unacknowledged events are sent to it again.
+#define RETRANSMIT_TIMEOUT 60
+
 struct ServerParameters {
     uint64_t rng;
     int64_t turningSpeed, rps, portNum, width, height;
+    // Maximal number of datagrams read from the socket on a single wakeup.
+    int64_t recvBatch;
+    // Number of rooms hosted by the server and of threads (besides the main one) simulating them.
+    int64_t rooms, workers;
+    // Number of threads receiving datagrams on their own SO_REUSEPORT sockets,
+    // 0 means the main thread receives them itself.
+    int64_t recvThreads;
+    // Path of the UNIX socket serving metrics, NULL if they aren't served.
+    const char *metricsPath;
+    // Directory of recordings, NULL if games aren't recorded, the number
+    // of recording files kept in it and their size in MiB.
+    const char *recordingDir;
+    int64_t recordingFiles, recordingFileSize;
+    // 1 if games are simulated by a thread of their own instead of the main one.
+    int64_t simThreads;
+    // Number of finished games of every room kept for clients catching up with them.
+    int64_t archivedGames;
+    // Memory budget of event logs in MiB.
+    int64_t logBudget;
 };
 
+// Positions of players are fixed-point numbers with FIXED_SHIFT fractional bits,
+// so the simulation doesn't depend on the floating point environment.
+#define FIXED_SHIFT 32
+#define FIXED_ONE (int64_t(1) << FIXED_SHIFT)
+#define FIXED_HALF (FIXED_ONE / 2)
+
 struct PlayerPos {
-    double x, y;
+    int64_t x, y;
     int direction;
     int turnDirection;
     int order;
 };
 
+// Fixed-point unit vectors of all integer directions in degrees.
+struct DirectionTable {
+    int64_t dx[360];
+    int64_t dy[360];
+};
+
 struct ClientInfo {
-    int timerId;
     uint64_t sessionId;
     std::string playerName;
+    int room;
+    // Time (in ms) after which the client is kicked and wheel tick of its timeout entry.
+    uint64_t deadline;
+    uint64_t wheelTick;
 };
 
 struct cmpInfo {
@@ -44,49 +157,430 @@ struct cmpInfo {
     }
 };
 
+// Packed bit grid of board fields that were already eaten by some worm,
+// field (x, y) is stored in bit y * width + x.
+struct OccupancyBoard {
+    int64_t width, height;
+    std::vector<uint64_t> bits;
+};
+
+struct LogSegment;
+
+// Accounting of segments of event logs under a memory budget. Sealed segments that are
+// in memory are kept on a list scanned by the clock algorithm: the ones used since the
+// last scan get a second chance, the others are spilled to an unlinked file in $TMPDIR.
+// The store is used only by the main thread, logs appended to by workers are settled with
+// it once they're done.
+struct SegmentStore {
+    // Bytes of events and their offsets of all segments in memory, and of protocol v2 pages
+    // cached for all games, which count against the budget too.
+    uint64_t budget, resident, pageBytes;
+    LogSegment *head, *tail;
+    // Spill file (-1 until the first spill) and its end, space of dropped segments is punched out of it.
+    int spillFd;
+    uint64_t spillEnd;
+    uint64_t spills, pageIns;
+};
+
+// Part of an event log holding size bytes of whole wrapped events, event i of the segment
+// starts at offsets[i] of data. Once the log moves on to the next segment this one is sealed
+// with its events events and never changes, so it can be spilled: its data and offsets are
+// written to the spill file at spillOffset and freed, then read back when they're needed.
+struct LogSegment {
+    std::vector<char> data;
+    std::vector<uint32_t> offsets;
+    uint32_t size, events;
+    bool sealed, resident, spilled, referenced;
+    uint64_t spillOffset;
+    // NULL when the log is never spilled, otherwise the bytes of the segment accounted in its
+    // resident bytes so far.
+    SegmentStore *store;
+    uint64_t accounted;
+    // Whether the segment is on the store's list, where it is while it's settled, sealed and
+    // in memory, and its neighbours there.
+    bool linked;
+    LogSegment *prev, *next;
+
+    ~LogSegment();
+};
+
+// Append-only log of wrapped events kept in segments of at most LOG_SEGMENT_SIZE bytes,
+// firstEvents[i] is the number of the first event in segment i.
+struct EventLog {
+    std::vector<std::unique_ptr<LogSegment>> segments;
+    std::vector<uint32_t> firstEvents;
+    // Number of events and their total size.
+    uint32_t events;
+    uint64_t bytes;
+    // Write position in the last segment and running CRC32 of the event that is being appended.
+    size_t cursor;
+    uint32_t crc;
+    // Store accounting for segments of the log, NULL if they all stay in memory,
+    // and the first segment whose bytes may not be accounted in it yet.
+    SegmentStore *store;
+    size_t settled;
+    // Logs are only moved, so that containers of games never try to copy their segments.
+    EventLog() = default;
+    EventLog(EventLog &&) = default;
+    EventLog &operator=(EventLog &&) = default;
+};
+
+// Datagram packed from events [from, to) of the event log, it holds size bytes
+// including the game id prefix. A page that is not full may still grow with the log.
+struct DatagramPage {
+    uint32_t to;
+    uint32_t size;
+    bool full;
+};
+
+// Protocol v2 datagram of events [from, to) of the event log: bytes hold everything
+// after the game id prefix, that is the marker, compact events and the CRC.
+struct CompactPage {
+    uint32_t to;
+    bool full;
+    std::vector<char> bytes;
+};
+
+// Keyframes are rebuilt once the log grows by KEYFRAME_INTERVAL events, clients
+// joining a game get one only when it saves them at least KEYFRAME_MIN_EVENTS events.
+#define KEYFRAME_INTERVAL 1024
+#define KEYFRAME_MIN_EVENTS 256
+
+// Part of a player's trail: pixel (x, y) followed by pixels reached with chain codes, ending at (endX, endY).
+struct TrailRun {
+    uint32_t x, y;
+    uint32_t endX, endY;
+    std::vector<uint8_t> codes;
+};
+
+// Board state folded from the first events of the log and the latest keyframe built from it.
+struct KeyframeState {
+    uint32_t folded;
+    uint32_t width, height;
+    // Null-terminated player names, as in the NEW_GAME event.
+    std::string names;
+    uint32_t eliminated;
+    std::vector<std::vector<TrailRun>> trails;
+    // The keyframe covers events [0, events), parts hold its datagrams after the game id prefix.
+    uint32_t events;
+    std::vector<std::vector<char>> parts;
+};
+
 struct GameState {
     bool active;
     uint32_t gameId;
-    EventVector events;
-    std::set<std::pair<int, int>> eatenFields;
+    // Big endian encoded game id, the prefix of every datagram of this game.
+    char gameIdPrefix[4];
+    EventLog events;
+    // Datagram pages keyed by their first event, shared by all clients.
+    std::unordered_map<uint32_t, DatagramPage> pages;
+    // Protocol v2 pages keyed by their first event and their total size. They're only a cache,
+    // so they're evicted when event logs exceed their budget.
+    std::unordered_map<uint32_t, CompactPage> compactPages;
+    uint64_t compactBytes;
+    KeyframeState keyframes;
+    // Number of events of the log already queued for recording.
+    uint32_t recorded;
+    OccupancyBoard eatenFields;
     std::map<ClientInfo, PlayerPos, cmpInfo> playerPos;
     std::set<ClientInfo, cmpInfo> readyPlayers;
 };
 
+// Independent match hosted by the server with its own game, rng and event logs.
+struct Room {
+    uint64_t rng;
+    GameState game;
+    // The last finished games, oldest first. They're moved here as a whole when they end.
+    std::deque<std::shared_ptr<GameState>> archive;
+    std::set<std::string> usedNames;
+    size_t sessions;
+};
+
+// Tasks queued for a single worker, the owner pops them from the back
+// and other workers steal them from the front.
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+};
+
+// Pool of threads running batches of tasks with work stealing, queues[0]
+// belongs to the thread submitting the batch, which helps running it.
+struct WorkerPool {
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    // Incremented whenever a new batch is queued.
+    uint64_t generation;
+    std::atomic<size_t> pending;
+    std::atomic<uint64_t> steals;
+    bool stop;
+};
+
 struct ClientMsg {
     uint64_t sessionId;
     uint8_t turnDirection;
+    uint8_t protocol;
+    bool keyframes;
     uint32_t nextExpectedEventNo;
     std::string playerName;
 };
 
+// Binary client address, IPv4 addresses are stored as v4-mapped IPv6 ones.
 struct ClientAddr {
-    int family;
-    std::string ip;
-    int port;
+    in6_addr ip;
+    uint16_t port;
+    uint32_t scopeId;
+};
+
+// Validated message together with the address of the client that has sent it.
+struct ClientInput {
+    ClientAddr addr;
+    sockaddr_in6 sockaddr;
+    ClientMsg msg;
 };
 
-struct cmpAddr {
-    bool operator()(const ClientAddr &a, const ClientAddr &b) const {
-        if (a.family == b.family) {
-            if (a.port == b.port) {
-                return a.ip < b.ip;
-            }
+// Lock-free ring buffer of fixed (power of two) capacity with a single producer
+// thread and a single consumer thread.
+template<typename T>
+struct SpscQueue {
+    std::vector<T> items;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
 
-            return a.port < b.port;
-        }
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
 
-        return a.family < b.family;
-    }
+#define MIN_REGISTRY_CAPACITY 64
+
+// Delivery state of events of game gameId to a client: events before acked were
+// confirmed by its last message and events before sent were sent to it. Events
+// in between are sent again only when acked doesn't move for RETRANSMIT_TIMEOUT
+// ms since rtoStart.
+struct DeliveryCursor {
+    uint32_t gameId;
+    uint32_t acked, sent;
+    uint64_t rtoStart;
+};
+
+// Registered client, sockaddr is ready to be used for sending datagrams to it.
+struct ClientSlot {
+    uint8_t state;
+    ClientAddr addr;
+    sockaddr_in6 sockaddr;
+    ClientInfo info;
+    DeliveryCursor cursor;
+    // Version of the protocol asked for in the client's last message and whether it asked for keyframes.
+    uint8_t protocol;
+    bool keyframes;
+};
+
+// Open addressing (linear probing) hash table of clients keyed by their address,
+// its capacity is a power of two and it is kept at most half full.
+struct ClientRegistry {
+    std::vector<ClientSlot> slots;
+    size_t size;
+};
+
+struct ServerStats {
+    uint64_t pageHits, pageMisses;
+    // Bytes of datagrams that were sent from cached pages instead of being packed again.
+    uint64_t pageBytesSaved;
+    uint64_t sendSyscalls, datagramsSent, datagramsDropped;
+    uint64_t recvSyscalls, datagramsReceived, maxRecvBatch, fullRecvBatches;
+    // Largest number of bytes left in the socket's receive queue after a full batch.
+    uint64_t maxRecvQueueBytes;
+    // Client requests answered with a retransmission and ones that needed no send at all.
+    uint64_t retransmits, sendsSkipped;
+    uint64_t keyframesSent;
+};
+
+// Histogram with power of two buckets, bucket 0 counts zeros and bucket i > 0
+// values in [2^(i - 1), 2^i), the last one counts all greater values too.
+struct Histogram {
+    std::atomic<uint64_t> buckets[METRIC_BUCKETS];
+    std::atomic<uint64_t> sum;
+};
+
+// Live server metrics. They're updated with relaxed atomic operations by the
+// threads that own the measured paths and read by the metrics thread at any time.
+struct Metrics {
+    std::atomic<uint64_t> packetsIn{0}, bytesIn{0}, packetsOut{0}, bytesOut{0};
+    // Inputs that failed validation and valid ones dropped on a full queue.
+    std::atomic<uint64_t> rejectedInputs{0}, droppedInputs{0};
+    std::atomic<uint64_t> sessions{0};
+    std::atomic<uint64_t> ticks{0};
+    // Total size of event logs of the current games of all rooms.
+    std::atomic<uint64_t> eventLogEvents{0}, eventLogBytes{0};
+    // Bytes of segments of all event logs in memory and of cached protocol v2 pages, segments
+    // spilled to disk and read back from it.
+    std::atomic<uint64_t> logResidentBytes{0}, logPageBytes{0}, logSpills{0}, logPageIns{0};
+    // Averages per tick of frames, and ticks of every frame simulated after their time.
+    Histogram eventsPerTick{}, tickDurationUs{}, overdueTicks{};
+    // Expirations of the game timer that weren't handled before the next one, frames that simulated
+    // more than one tick because the loop fell behind and the most ticks it was late. They're written
+    // only by the thread simulating games.
+    std::atomic<uint64_t> tickOverruns{0}, catchUpFrames{0}, maxOverdueTicks{0};
+    // Per frame: how late its first tick started, time of simulation and of sending its events.
+    Histogram tickLatenessUs{}, simDurationUs{}, sendDurationUs{};
+    // Statistics of the main thread, copied from its ServerStats after every poll.
+    std::atomic<uint64_t> pageHits{0}, pageMisses{0}, pageBytesSaved{0};
+    std::atomic<uint64_t> sendSyscalls{0}, datagramsSent{0}, datagramsDropped{0};
+    std::atomic<uint64_t> recvSyscalls{0}, datagramsReceived{0}, maxRecvBatch{0}, fullRecvBatches{0};
+    std::atomic<uint64_t> maxRecvQueueBytes{0}, retransmits{0}, sendsSkipped{0}, keyframesSent{0};
+};
+
+// Counts of a histogram at some point, so that reports can cover what was observed since then.
+struct HistogramCounts {
+    uint64_t buckets[METRIC_BUCKETS];
+    uint64_t sum;
+};
+
+// Tick loop metrics at the time of a report.
+struct TickReport {
+    uint64_t timeMs, ticks, overruns;
+    HistogramCounts lateness, sim, send;
+};
+
+// Game timer of the thread simulating games, its expiration n is due at armedNs + n * periodNs.
+struct TickLoop {
+    int timer;
+    bool armed;
+    uint64_t armedNs, periodNs, expirations;
+    // Monotonic time in ms when the server started and tick loop metrics at the previous periodic report.
+    uint64_t startMs;
+    TickReport lastReport;
+};
+
+// Datagrams queued to be sent with a single sendmmsg, datagram i goes to
+// addrs[recipients[i]] and consists of iovs 2i (game id) and 2i + 1 (events).
+// Game states of the queued datagrams must not change until the batch is flushed.
+struct SendBatch {
+    std::vector<sockaddr_in6> addrs;
+    std::vector<size_t> recipients;
+    std::vector<iovec> iovs;
+    std::vector<mmsghdr> msgs;
+};
+
+// Buffers for datagrams read with a single recvmmsg, datagram i is stored
+// in bufs[i * MAX_EVENT_SIZE...] and was sent from addrs[i].
+struct RecvBatch {
+    std::vector<char> bufs;
+    std::vector<sockaddr_storage> addrs;
+    std::vector<iovec> iovs;
+    std::vector<mmsghdr> msgs;
+};
+
+// Receive thread with its own SO_REUSEPORT socket, passing validated messages
+// to the main thread through its queue.
+struct RecvShard {
+    int sock;
+    std::thread thread;
+    RecvBatch batch;
+    SpscQueue<ClientInput> inputs;
+    std::atomic<uint64_t> recvSyscalls{0}, datagramsReceived{0}, rejected{0}, queueDrops{0};
+};
+
+// Consecutive wrapped events of a game queued for recording.
+struct RecordChunk {
+    uint32_t gameId, room, firstEvent, events;
+    uint64_t timeMs;
+    std::vector<char> bytes;
+};
+
+// Asynchronous game recorder: the main thread queues new events after every tick and
+// the writer thread appends them to the mapped recording file. Files are rotated
+// when full, only the last maxFiles of them are kept.
+struct Recorder {
+    std::string dir;
+    int64_t maxFiles;
+    uint64_t fileSize;
+    SpscQueue<RecordChunk> chunks;
+    // Event counter the main thread uses to wake the writer up, and whether
+    // the writer is to close the current file and finish once the queue is empty.
+    int wakeEvent;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+    // Sequence number and mapping of the current file, used only by the writer.
+    uint64_t sequence;
+    RecordingHeader *file;
+    std::atomic<uint64_t> chunksWritten{0}, bytesWritten{0}, drops{0}, files{0};
+};
+
+// Command of the main thread to the simulation thread: either a game that has just started
+// in the room, to be simulated from now on, or a new turn direction of the player with
+// given order in the room's game gameId.
+struct SimCommand {
+    uint32_t room, gameId;
+    int order, turnDirection;
+    std::unique_ptr<GameState> game;
+};
+
+// New wrapped events [firstEvent, firstEvent + events) of the room's game gameId,
+// passed from the simulation thread to the main thread.
+struct EventRange {
+    uint32_t room, gameId, firstEvent, events;
+    std::vector<char> bytes;
+};
+
+// Thread simulating games so that ticks are on time regardless of the load of datagrams
+// on the main thread, which starts the games and hands them over. The simulation thread
+// owns the games from then on, it gets turns of players through commands and passes
+// new events back in ranges, which the main thread appends to its copies of the logs.
+struct Simulation {
+    std::thread thread;
+    // Games of the rooms and the number of their events already passed to the main thread.
+    std::vector<Room> rooms;
+    std::vector<uint32_t> published;
+    TickLoop tickLoop;
+    SpscQueue<SimCommand> commands;
+    SpscQueue<EventRange> ranges;
+    // Event counters waking the simulation thread up with a started game and the main thread with new ranges.
+    int commandEvent, rangeEvent;
+};
+
+// Hashed timer wheel of client timeouts, slot t % WHEEL_SLOTS holds addresses of
+// clients to be checked at wheel tick t. Renewing a client only moves its deadline,
+// an entry whose deadline has moved is rescheduled when its tick comes.
+struct TimerWheel {
+    std::vector<std::vector<ClientAddr>> slots;
+    uint64_t tick;
+};
+
+// Callback run with epoll events reported for the descriptor it was registered for.
+using ReadyCallback = std::function<void(uint32_t events)>;
+
+// epoll based event loop dispatching readiness of registered descriptors to their callbacks.
+struct Reactor {
+    int epollFd;
+    std::map<int, ReadyCallback> callbacks;
+    epoll_event ready[MAX_REACTOR_EVENTS];
 };
 
 struct ServerNetworkData {
-    pollfd client[MAX_PLAYERS + 2];
+    // Socket used for sending, with receive threads it belongs to the first of them.
+    int sock;
+    // Used only when games are simulated by the main thread.
+    TickLoop tickLoop;
+    // Receive threads and event counter they use to wake the main thread up.
+    std::vector<std::unique_ptr<RecvShard>> shards;
+    int inputEvent;
     sockaddr_in6 server;
-    char buf[MAX_EVENT_SIZE];
-    std::map<ClientAddr, ClientInfo, cmpAddr> clientId;
-    std::set<int> freeTimerIds;
-    std::set<std::string> usedNames;
+    ClientRegistry clientId;
+    TimerWheel wheel;
+    // Monotonic time in ms, updated on every wakeup.
+    uint64_t now;
+    ServerStats stats;
+    SendBatch batch;
+    RecvBatch recv;
+    std::unique_ptr<Metrics> metrics;
+    // Null when games aren't recorded.
+    std::unique_ptr<Recorder> recorder;
+    // Null when games are simulated by the main thread.
+    std::unique_ptr<Simulation> sim;
+    // Segments of event logs of all games, current and archived.
+    std::unique_ptr<SegmentStore> logStore;
 };
 
 
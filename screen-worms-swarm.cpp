@@ -0,0 +1,264 @@
+// Load generator simulating many clients of screen-worms-server from a single process.
+#define SCREEN_WORMS_NO_MAIN
+#include "screen-worms-client.cpp"
+#include "screen-worms-swarm.h"
+
+// Parses shell options, sets params accordingly or terminates when they are incorrect.
+void getOptions(SwarmParameters &params, int argc, char **argv) {
+    int opt;
+    int cnt = 0;
+    while ((opt = getopt(argc, argv, "p:n:m:d:")) != -1) {
+        cnt += 2;
+        switch (opt) {
+        case 'p':
+            params.serverPort = getValFromOptarg(0, MAX_PORT, "Invalid server port");
+            break;
+
+        case 'n':
+            params.sessions = getValFromOptarg(MIN_SWARM_SESSIONS, MAX_SWARM_SESSIONS, "Invalid number of sessions");
+            break;
+
+        case 'm':
+            params.players = getValFromOptarg(0, MAX_SWARM_SESSIONS, "Invalid number of players");
+            break;
+
+        case 'd':
+            params.duration = getValFromOptarg(MIN_SWARM_DURATION, MAX_SWARM_DURATION, "Invalid duration");
+            break;
+
+        default:
+            std::cerr << "Option is not supported\n";
+            exit(1);
+        }
+    }
+
+    if (cnt != argc - 2) {
+        std::cerr << "Invalid arguments\n";
+        exit(1);
+    }
+
+    params.players = std::min(params.players, params.sessions);
+}
+
+// Returns monotonic time in nanoseconds.
+uint64_t monotonicNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Raises the limit of open descriptors as far as allowed, one is needed per session.
+void raiseFileLimit(SwarmParameters &params) {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        syserr("getrlimit");
+    }
+
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        syserr("setrlimit");
+    }
+
+    if ((int64_t)limit.rlim_cur < params.sessions + 16) {
+        fatal("Too many sessions for the limit of open files (%lu)", (uint64_t)limit.rlim_cur);
+    }
+}
+
+// Opens sockets of all sessions and registers them in the swarm's epoll instance.
+void setupSwarm(SwarmParameters &params, Swarm &swarm) {
+    std::string port = std::to_string(params.serverPort);
+    swarm.serverAddr = getSockaddr(params.serverName, &port[0], SOCK_DGRAM);
+    if ((swarm.epollFd = epoll_create1(0)) == -1) {
+        syserr("epoll_create1()");
+    }
+
+    uint64_t sessionId = curTime();
+    swarm.sessions.resize(params.sessions);
+    for (int64_t i = 0; i < params.sessions; i++) {
+        SwarmSession &session = swarm.sessions[i];
+        session.sock = getServerSock();
+        session.player = i < params.players;
+        session.params.sessionId = sessionId + i;
+        if (session.player) {
+            session.params.playerName = "swarm" + std::to_string(i);
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        if (epoll_ctl(swarm.epollFd, EPOLL_CTL_ADD, session.sock, &event) == -1) {
+            syserr("epoll_ctl()");
+        }
+    }
+}
+
+// Sends the session's move message, players turn according to a fixed script.
+void sendMove(Swarm &swarm, size_t sessionNo, uint64_t round) {
+    SwarmSession &session = swarm.sessions[sessionNo];
+    if (session.player) {
+        session.params.turnDirection = (round / SWARM_TURN_PERIOD + sessionNo) % 3;
+    }
+
+    std::string msg = createMoveMsg(session.params);
+    if (sendto(session.sock, msg.c_str(), msg.size(), 0,
+               (sockaddr *)&swarm.serverAddr, sizeof(swarm.serverAddr)) == -1 && errno != EAGAIN) {
+        syserr("sendto");
+    }
+
+    swarm.stats.movesSent++;
+    if (session.moveSentNs == 0) {
+        session.moveSentNs = monotonicNs();
+    }
+}
+
+// Accounts for a single datagram received by the session at given time.
+void handleDatagram(Swarm &swarm, SwarmSession &session, const char *buf, ssize_t len, uint64_t now) {
+    swarm.stats.datagrams++;
+    swarm.stats.bytes += len;
+    if (len < 4) {
+        return;
+    }
+
+    ClientParameters &params = session.params;
+    uint32_t gameId = getBigEndian(buf, 4);
+    if (params.gameId != gameId) {
+        params.gameId = gameId;
+        params.nextExpectedEventNo = 0;
+        params.finished = false;
+    }
+
+    std::vector<uint64_t> &firstSeen = swarm.firstSeen[gameId];
+    uint32_t eventsBefore = params.nextExpectedEventNo;
+    for (ssize_t offset = 4; offset + MIN_EVENT_SIZE <= len;) {
+        uint32_t eventLen = getBigEndian(buf + offset, 4);
+        if ((uint64_t)offset + eventLen + 8 > (uint64_t)len || eventLen < 5
+            || crc32(buf + offset, eventLen + 4) != getBigEndian(buf + offset + 4 + eventLen, 4)) {
+            swarm.stats.badCrc++;
+            break;
+        }
+
+        uint32_t eventNo = getBigEndian(buf + offset + 4, 4);
+        uint8_t eventType = buf[offset + 8];
+        offset += eventLen + 8;
+
+        if (firstSeen.size() <= eventNo) {
+            firstSeen.resize(eventNo + 1, 0);
+        }
+        if (firstSeen[eventNo] == 0) {
+            firstSeen[eventNo] = now;
+        }
+
+        if (eventNo == params.nextExpectedEventNo) {
+            params.nextExpectedEventNo++;
+            params.finished |= eventType == GAME_OVER_EVENT;
+            swarm.stats.events++;
+            swarm.stats.fanoutSkewUs.push_back((now - firstSeen[eventNo]) / 1000);
+        } else if (eventNo > params.nextExpectedEventNo) {
+            swarm.stats.gaps++;
+        } else {
+            swarm.stats.duplicates++;
+        }
+    }
+
+    if (params.nextExpectedEventNo != eventsBefore && session.moveSentNs != 0) {
+        swarm.stats.deliveryUs.push_back((now - session.moveSentNs) / 1000);
+        session.moveSentNs = 0;
+    }
+}
+
+// Reads all datagrams waiting on the session's socket.
+void receiveDatagrams(Swarm &swarm, SwarmSession &session) {
+    char buf[MAX_EVENT_SIZE];
+    ssize_t len;
+    while ((len = recv(session.sock, buf, MAX_EVENT_SIZE, MSG_DONTWAIT)) >= 0) {
+        handleDatagram(swarm, session, buf, len, monotonicNs());
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED) {
+        syserr("recv");
+    }
+}
+
+// Returns the p-th percentile of latencies, reordering them.
+uint32_t percentile(std::vector<uint32_t> &latencies, double p) {
+    if (latencies.empty()) {
+        return 0;
+    }
+
+    auto nth = latencies.begin() + std::min(latencies.size() - 1, (size_t)(p / 100 * latencies.size()));
+    std::nth_element(latencies.begin(), nth, latencies.end());
+    return *nth;
+}
+
+// Prints the results of the run as a single line of key=value pairs.
+void printResults(SwarmParameters &params, Swarm &swarm, double seconds) {
+    SwarmStats &stats = swarm.stats;
+    uint64_t missing = 0;
+    for (auto &session : swarm.sessions) {
+        auto it = swarm.firstSeen.find(session.params.gameId);
+        if (it != swarm.firstSeen.end()) {
+            missing += it->second.size() - session.params.nextExpectedEventNo;
+        }
+    }
+
+    printf("swarm sessions=%ld players=%ld seconds=%.1f moves_sent=%lu datagrams=%lu bytes=%lu events=%lu "
+           "datagrams_per_sec=%.0f bytes_per_sec=%.0f events_per_sec=%.0f gaps=%lu duplicates=%lu bad_crc=%lu "
+           "missing=%lu loss=%.5f delivery_p50_us=%u delivery_p90_us=%u delivery_p99_us=%u delivery_p999_us=%u "
+           "delivery_max_us=%u fanout_skew_p50_us=%u fanout_skew_p99_us=%u fanout_skew_max_us=%u\n",
+           params.sessions, params.players, seconds, stats.movesSent, stats.datagrams, stats.bytes, stats.events,
+           stats.datagrams / seconds, stats.bytes / seconds, stats.events / seconds, stats.gaps,
+           stats.duplicates, stats.badCrc, missing, (double)missing / std::max<uint64_t>(stats.events + missing, 1),
+           percentile(stats.deliveryUs, 50), percentile(stats.deliveryUs, 90),
+           percentile(stats.deliveryUs, 99), percentile(stats.deliveryUs, 99.9),
+           percentile(stats.deliveryUs, 100), percentile(stats.fanoutSkewUs, 50),
+           percentile(stats.fanoutSkewUs, 99), percentile(stats.fanoutSkewUs, 100));
+}
+
+// Sends move messages of the sessions spread evenly over every MSG_FREQUENCY ms
+// and receives events until params.duration seconds pass.
+void runSwarm(SwarmParameters &params, Swarm &swarm) {
+    uint64_t period = MSG_FREQUENCY * 1000000ULL;
+    uint64_t start = monotonicNs(), end = start + params.duration * 1000000000ULL;
+    uint64_t round = 0, nextSession = 0, now = start;
+    while (now < end) {
+        uint64_t due;
+        while ((due = start + round * period + nextSession * period / params.sessions) <= now) {
+            sendMove(swarm, nextSession, round);
+            if (++nextSession == (uint64_t)params.sessions) {
+                nextSession = 0;
+                round++;
+            }
+        }
+
+        int timeout = (std::min(due, end) - now + 999999) / 1000000;
+        int count = epoll_wait(swarm.epollFd, swarm.ready, MAX_SWARM_EVENTS, timeout);
+        if (count == -1 && errno != EINTR) {
+            syserr("epoll_wait()");
+        }
+
+        for (int i = 0; i < count; i++) {
+            receiveDatagrams(swarm, swarm.sessions[swarm.ready[i].data.u64]);
+        }
+
+        now = monotonicNs();
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '\0' || argv[1][0] == '-') {
+        std::cerr << "usage ./screen-worms-swarm game_server [-p n] [-n n] [-m n] [-d n]\n";
+        exit(1);
+    }
+
+    SwarmParameters params{argv[1], DEFAULT_SERVER_PORT, DEFAULT_SWARM_SESSIONS,
+                           DEFAULT_SWARM_PLAYERS, DEFAULT_SWARM_DURATION};
+    getOptions(params, argc, argv);
+    raiseFileLimit(params);
+
+    Swarm swarm{};
+    setupSwarm(params, swarm);
+
+    uint64_t start = monotonicNs();
+    runSwarm(params, swarm);
+    printResults(params, swarm, (monotonicNs() - start) / 1e9);
+}
@@ -0,0 +1,63 @@
+#ifndef SCREEN_WORMS_SWARM_H
+#define SCREEN_WORMS_SWARM_H
+
+#include "screen-worms-client.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define MIN_SWARM_SESSIONS 1
+#define DEFAULT_SWARM_SESSIONS 200
+#define MAX_SWARM_SESSIONS 100000
+
+#define DEFAULT_SWARM_PLAYERS 25
+
+#define MIN_SWARM_DURATION 1
+#define DEFAULT_SWARM_DURATION 10
+#define MAX_SWARM_DURATION 86400
+
+// Number of move messages after which a scripted player changes its turn direction.
+#define SWARM_TURN_PERIOD 20
+
+#define MAX_SWARM_EVENTS 64
+
+struct SwarmParameters {
+    char *serverName;
+    int serverPort;
+    int64_t sessions;
+    // The first players sessions play, the rest of them only watch.
+    int64_t players;
+    // Length of the run in seconds.
+    int64_t duration;
+};
+
+// A single simulated client, params are kept in the same way as by screen-worms-client.
+struct SwarmSession {
+    int sock;
+    bool player;
+    ClientParameters params;
+    // Send time of the oldest move message not followed by new events yet, 0 if there is none.
+    uint64_t moveSentNs;
+};
+
+struct SwarmStats {
+    uint64_t movesSent, datagrams, bytes, events;
+    // Events received ahead of the next expected one and events received again.
+    uint64_t gaps, duplicates;
+    uint64_t badCrc;
+    // Time from a session's move message to the first datagram with new events after it, and
+    // the delay of every delivered event after its first arrival at any session, in microseconds.
+    std::vector<uint32_t> deliveryUs, fanoutSkewUs;
+};
+
+struct Swarm {
+    sockaddr_in6 serverAddr;
+    int epollFd;
+    std::vector<SwarmSession> sessions;
+    // Time of the first arrival of every event of every game at any session.
+    std::unordered_map<uint32_t, std::vector<uint64_t>> firstSeen;
+    SwarmStats stats;
+    epoll_event ready[MAX_SWARM_EVENTS];
+};
+
+#endif //SCREEN_WORMS_SWARM_H